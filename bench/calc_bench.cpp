@@ -0,0 +1,187 @@
+#include <benchmark/benchmark.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "calculator.h"
+#include "thread_pool.h"
+
+// Expression shapes. Sizes are token counts, so the tiny and 10k-token
+// cases of every shape are directly comparable.
+static std::string flatExpression(size_t tokens) {
+    static const char OPS[] = "+-*/";
+    std::string text = "1";
+    for (size_t i = 1; i + 1 < tokens; i += 2) {
+        text += OPS[(i / 2) % 4];
+        text += std::to_string(i % 9 + 1);
+    }
+    return text;
+}
+
+// 1+(2*(3-(4+(...)))), one bracket pair per four tokens
+static std::string nestedExpression(size_t tokens) {
+    static const char OPS[] = "+*-+";
+    std::string text;
+    size_t depth = 0;
+    for (size_t used = 0; used + 5 < tokens; used += 4) {
+        text += std::to_string(depth % 9 + 1);
+        text += OPS[depth % 4];
+        text += '(';
+        depth++;
+    }
+    text += "1+2";
+    text.append(depth, ')');
+    return text;
+}
+
+static void sizeArgs(benchmark::internal::Benchmark* bench) {
+    bench->Arg(8)->Arg(10000);
+}
+
+// The validation the lexer replaced
+static void BM_ValidateRegex(benchmark::State& state) {
+    const std::regex VALID_EXPRESSION{"^[\\s]*([(){}]|\\d+(\\.\\d+)?|[+\\-*/^])+[\\s]*$"};
+    std::string expression = flatExpression(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(std::regex_match(expression, VALID_EXPRESSION));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(expression.size()));
+}
+BENCHMARK(BM_ValidateRegex)->Arg(8)->Arg(1000)->Arg(10000);
+
+static void BM_ValidateLexer(benchmark::State& state) {
+    const Calculator calc;
+    std::string expression = flatExpression(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        calc.validateExpression(expression);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(expression.size()));
+}
+BENCHMARK(BM_ValidateLexer)->Arg(8)->Arg(1000)->Arg(10000);
+
+// Parse, compile and run without the cache, as for a formula seen once
+template <std::string (*Shape)(size_t)>
+static void BM_CompileAndRun(benchmark::State& state) {
+    const Calculator calc;
+    std::string expression = Shape(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calc.run(calc.compile(expression)));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(expression.size()));
+}
+BENCHMARK_TEMPLATE(BM_CompileAndRun, flatExpression)->Name("BM_CompileAndRun/flat")->Apply(sizeArgs);
+BENCHMARK_TEMPLATE(BM_CompileAndRun, nestedExpression)->Name("BM_CompileAndRun/nested")->Apply(sizeArgs);
+
+// Repeated formula: cache lookup plus the optimized program
+template <std::string (*Shape)(size_t)>
+static void BM_EvaluateCached(benchmark::State& state) {
+    const Calculator calc;
+    std::string expression = Shape(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calc.evaluate(expression));
+    }
+}
+BENCHMARK_TEMPLATE(BM_EvaluateCached, flatExpression)->Name("BM_EvaluateCached/flat")->Apply(sizeArgs);
+BENCHMARK_TEMPLATE(BM_EvaluateCached, nestedExpression)->Name("BM_EvaluateCached/nested")->Apply(sizeArgs);
+
+// Same uncached work with step tracing off (0) and on (1)
+static void BM_Trace(benchmark::State& state) {
+    const Calculator calc;
+    EvalContext context;
+    std::string expression = nestedExpression(static_cast<size_t>(state.range(1)));
+    bool trace = state.range(0) != 0;
+    for (auto _ : state) {
+        if (trace) {
+            benchmark::DoNotOptimize(calc.evaluate(expression, context));
+        } else {
+            benchmark::DoNotOptimize(calc.run(calc.compile(expression)));
+        }
+    }
+}
+BENCHMARK(BM_Trace)->ArgNames({"trace", "tokens"})->ArgsProduct({{0, 1}, {8, 10000}});
+
+// Batch throughput in rows per second over two input columns
+enum BatchMode { INTERPRETED, NATIVE, PARALLEL };
+
+static void BM_Batch(benchmark::State& state) {
+    const Calculator calc;
+    auto mode = static_cast<BatchMode>(state.range(0));
+    size_t rows = static_cast<size_t>(state.range(1));
+    const char* expression = "x*y+(x-y)/(x+2)-y^2";
+
+    // Cached programs reach the native tier once hot; a plain compile
+    // stays on the SIMD interpreter
+    Program plain = calc.optimize(calc.compile(expression));
+    std::shared_ptr<const Program> cached = calc.compileCached(expression);
+    const Program& program = mode == INTERPRETED ? plain : *cached;
+
+    std::vector<double> x(rows), y(rows), out(rows);
+    for (size_t i = 0; i < rows; i++) {
+        x[i] = 1.0 + static_cast<double>(i % 1000) / 7;
+        y[i] = 0.5 + static_cast<double>(i % 37);
+    }
+    std::vector<std::span<const double>> columns{x, y};
+
+    for (auto _ : state) {
+        if (mode == PARALLEL) {
+            calc.evaluateBatch(program, columns, out, ThreadPool::shared());
+        } else {
+            calc.evaluateBatch(program, columns, out);
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.counters["rows/s"] = benchmark::Counter(static_cast<double>(rows), benchmark::Counter::kIsIterationInvariantRate);
+    state.SetLabel(mode == INTERPRETED ? SimdEvaluator::isaName() : mode == NATIVE ? "native" : "parallel");
+}
+BENCHMARK(BM_Batch)->ArgNames({"mode", "rows"})->ArgsProduct({{INTERPRETED, NATIVE, PARALLEL}, {1 << 10, 1 << 20}});
+
+// Traffic with one malformed line in 20, through evaluate() with a catch
+// (0) and through tryEvaluate() (1)
+static void BM_Malformed(benchmark::State& state) {
+    const Calculator calc;
+    bool expected = state.range(0) != 0;
+    std::vector<std::string> lines;
+    for (int i = 0; i < 1000; i++) {
+        std::string line = std::to_string(i);
+        if (i % 20 == 0) line.insert(0, 1, '(');
+        lines.push_back(line + (i % 20 == 0 ? "+2" : "*2+1"));
+    }
+    for (auto _ : state) {
+        for (const std::string& line : lines) {
+            if (expected) {
+                benchmark::DoNotOptimize(calc.tryEvaluate(line));
+            } else {
+                try {
+                    benchmark::DoNotOptimize(calc.evaluate(line));
+                } catch (const std::exception&) {
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(lines.size()));
+}
+BENCHMARK(BM_Malformed)->ArgName("expected")->Arg(0)->Arg(1);
+
+// Scalar interpreter runs of the formula shapes fusion targets, on plain
+// code (0) and with superinstructions (1). The programs are not cached, so
+// the native tier never takes over.
+static void BM_Fusion(benchmark::State& state) {
+    static const char* const SHAPES[] = {
+        "a*b+c", "a*a+b^2+c*c*c", "a+b+c+d+e+f+g+h", "a*b+c*d+e*f+g*h", "a*b+(a-b)/(a+2)-b^2"};
+    const Calculator calc;
+    const char* expression = SHAPES[state.range(1)];
+    Program program = calc.optimize(calc.compile(expression));
+    if (state.range(0)) program.fused = Fusion::fuse(program);
+    std::vector<double> inputs(program.variables.size());
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = 1.5 + static_cast<double>(i);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(inputs.data());
+        benchmark::DoNotOptimize(calc.run(program, inputs));
+    }
+    state.SetLabel(expression);
+}
+BENCHMARK(BM_Fusion)->ArgNames({"fused", "shape"})->ArgsProduct({{0, 1}, {0, 1, 2, 3, 4}});
+
+BENCHMARK_MAIN();
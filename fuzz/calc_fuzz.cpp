@@ -0,0 +1,71 @@
+// libFuzzer entry point. Any byte string is an expression: it must either
+// evaluate or be rejected with a std::exception, never crash or hang, the
+// optimized program must agree with the plain one, and its fused code must
+// give exactly the same result.
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string_view>
+
+#include "calculator.h"
+#include "fusion.h"
+
+namespace {
+
+// Keeps every run short; deeper and longer inputs only exercise the limits
+const InputLimits FUZZ_LIMITS{4096, 256};
+
+// Result of one run: the value, or that it threw
+struct Outcome {
+    bool threw = false;
+    double value = 0;
+};
+
+Outcome runProgram(const Calculator& calc, const Program& program) {
+    try {
+        return {false, calc.run(program)};
+    } catch (const std::exception&) {
+        return {true, 0};
+    }
+}
+
+bool same(const Outcome& a, const Outcome& b) {
+    if (a.threw || b.threw) return a.threw == b.threw;
+    if (a.value == b.value || (std::isnan(a.value) && std::isnan(b.value))) return true;
+    // x^2 becomes x*x, which pow() may round differently in the last bit
+    return std::fabs(a.value - b.value) <= 1e-12 * std::fabs(a.value);
+}
+
+bool identical(const Outcome& a, const Outcome& b) {
+    if (a.threw || b.threw) return a.threw == b.threw;
+    if (std::isnan(a.value) && std::isnan(b.value)) return true;
+    return std::bit_cast<std::uint64_t>(a.value) == std::bit_cast<std::uint64_t>(b.value);
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, size_t size) {
+    static const Calculator calc(FUZZ_LIMITS);
+    std::string_view expression(reinterpret_cast<const char*>(data), size);
+
+    Program program;
+    try {
+        program = calc.compile(expression);
+    } catch (const std::exception&) {
+        return 0;
+    }
+    // Unbound variables make every run throw; the optimizer still has to
+    // accept the program
+    Program optimized = calc.optimize(program);
+    if (!program.variables.empty()) return 0;
+
+    Outcome expected = runProgram(calc, optimized);
+    if (!same(runProgram(calc, program), expected)) __builtin_trap();
+
+    Program fused = optimized;
+    fused.fused = Fusion::fuse(optimized);
+    if (!identical(runProgram(calc, fused), expected)) __builtin_trap();
+    return 0;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <expected>
+#include <latch>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "calculator.h"
+#include "thread_pool.h"
+
+// Non-interactive evaluation of one expression per line. Input is mapped or
+// read in large blocks, lines are evaluated in place as string_views on the
+// thread pool, and results are written in input order through a single
+// buffered stream that is never flushed per line. Each output line is the
+// result, or "Error: <message>" for an expression that failed.
+class BatchRunner {
+private:
+    // Input text evaluated per parallel round
+    static constexpr size_t SEGMENT_BYTES = 8 << 20;
+    static constexpr size_t READ_BYTES = 1 << 20;
+    static constexpr size_t OUTPUT_BUFFER_BYTES = 1 << 20;
+    static constexpr size_t LINES_PER_TASK = 4096;
+
+    const Calculator& calc;
+    ThreadPool& pool;
+    std::FILE* out;
+
+    std::vector<std::string_view> lines;
+    std::vector<std::string> results;       // One buffer per task, reused between rounds
+
+    // Malformed lines are reported without throwing
+    void appendResult(std::string& buffer, std::string_view line) const {
+        try {
+            std::expected<double, EvalError> result = calc.tryEvaluate(line);
+            if (result) {
+                calc.formatResult(buffer, *result);
+            } else {
+                buffer += "Error: ";
+                buffer += calc.describe(result.error(), line);
+            }
+        } catch (const std::exception& e) {
+            buffer += "Error: ";
+            buffer += e.what();
+        }
+        buffer += '\n';
+    }
+
+    void evaluateTask(size_t task) {
+        std::string& buffer = results[task];
+        buffer.clear();
+        size_t end = std::min(lines.size(), (task + 1) * LINES_PER_TASK);
+        for (size_t i = task * LINES_PER_TASK; i < end; i++) {
+            appendResult(buffer, lines[i]);
+        }
+    }
+
+    // Evaluates every line of `text`; a final line needs no terminator
+    void processLines(std::string_view text) {
+        lines.clear();
+        while (!text.empty()) {
+            size_t newline = text.find('\n');
+            if (newline == std::string_view::npos) newline = text.size();
+            lines.push_back(text.substr(0, newline));
+            text.remove_prefix(std::min(newline + 1, text.size()));
+        }
+        if (lines.empty()) return;
+
+        size_t tasks = (lines.size() + LINES_PER_TASK - 1) / LINES_PER_TASK;
+        if (results.size() < tasks) results.resize(tasks);
+
+        // The calling thread takes the first task itself
+        std::latch done(static_cast<std::ptrdiff_t>(tasks - 1));
+        for (size_t task = 1; task < tasks; task++) {
+            pool.submit([this, task, &done] {
+                evaluateTask(task);
+                done.count_down();
+            });
+        }
+        evaluateTask(0);
+        done.wait();
+
+        for (size_t task = 0; task < tasks; task++) {
+            std::fwrite(results[task].data(), 1, results[task].size(), out);
+        }
+    }
+
+    // Splits a large text into segments that end on line boundaries
+    void processText(std::string_view text) {
+        while (text.size() > SEGMENT_BYTES) {
+            size_t cut = text.rfind('\n', SEGMENT_BYTES);
+            cut = cut == std::string_view::npos ? text.size() : cut + 1;
+            processLines(text.substr(0, cut));
+            text.remove_prefix(cut);
+        }
+        processLines(text);
+    }
+
+public:
+    BatchRunner(const Calculator& calc, ThreadPool& pool, std::FILE* out)
+        : calc(calc), pool(pool), out(out) {
+        std::setvbuf(out, nullptr, _IOFBF, OUTPUT_BUFFER_BYTES);
+    }
+
+    // Reads `in` block by block until end of file
+    void runStream(std::FILE* in) {
+        std::vector<char> buffer(SEGMENT_BYTES + READ_BYTES);
+        size_t filled = 0;
+        while (true) {
+            // A line longer than a segment grows the buffer
+            if (buffer.size() < filled + READ_BYTES) buffer.resize(filled + READ_BYTES);
+            size_t count = std::fread(buffer.data() + filled, 1, READ_BYTES, in);
+            filled += count;
+            if (count == 0) break;
+            if (filled < SEGMENT_BYTES) continue;
+
+            std::string_view text(buffer.data(), filled);
+            size_t cut = text.rfind('\n');
+            if (cut == std::string_view::npos) continue;
+            processLines(text.substr(0, cut + 1));
+            filled -= cut + 1;
+            std::copy(buffer.begin() + cut + 1, buffer.begin() + cut + 1 + filled, buffer.begin());
+        }
+        processLines(std::string_view(buffer.data(), filled));
+        std::fflush(out);
+    }
+
+    // Maps a regular file and evaluates it in place; anything that cannot
+    // be mapped is streamed instead. Returns false if the file cannot be opened.
+    bool runFile(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            size_t size = static_cast<size_t>(info.st_size);
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                ::madvise(data, size, MADV_SEQUENTIAL);
+                processText(std::string_view(static_cast<const char*>(data), size));
+                ::munmap(data, size);
+                ::close(fd);
+                std::fflush(out);
+                return true;
+            }
+        }
+
+        std::FILE* in = ::fdopen(fd, "rb");
+        if (!in) {
+            ::close(fd);
+            return false;
+        }
+        runStream(in);
+        std::fclose(in);
+        return true;
+    }
+};
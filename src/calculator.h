@@ -0,0 +1,880 @@
+#pragma once
+
+#include <iostream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <cctype>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "eval_context.h"
+#include "eval_error.h"
+#include "fusion.h"
+#include "jit.h"
+#include "lexer.h"
+#include "numeric.h"
+#include "operations.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+#include "program_cache.h"
+#include "program_file.h"
+#include "simd_evaluator.h"
+#include "stats.h"
+#include "task.h"
+#include "thread_pool.h"
+
+// Hard limits on the expressions a Calculator accepts, checked before any
+// expensive work. Longer or deeper input is rejected with invalid_argument.
+// With a memory budget, an expression whose tokens show it could need more
+// is rejected with MemoryBudgetExceeded before it is compiled.
+struct InputLimits {
+    size_t maxLength = static_cast<size_t>(-1);     // Bytes of expression text
+    size_t maxDepth = Parser::MAX_DEPTH;            // Brackets and prefix or right-associative chains
+    size_t maxMemory = static_cast<size_t>(-1);     // Bytes to compile, optimize and run one row
+};
+
+struct MemoryBudgetExceeded : std::runtime_error {
+    size_t required;
+    size_t budget;
+
+    MemoryBudgetExceeded(size_t required, size_t budget)
+        : std::runtime_error("Memory budget exceeded: " + std::to_string(required) + " bytes needed, " +
+                             std::to_string(budget) + " allowed"),
+          required(required), budget(budget) {}
+};
+
+// Immutable evaluation engine; every member function is const and safe to
+// call concurrently. The compiled-program cache and the metrics collector
+// are the only internal state and synchronize themselves.
+class Calculator {
+private:
+    static constexpr size_t DEFAULT_CACHE_CAPACITY = 4096;
+
+    InputLimits limits;
+    mutable ProgramCache cache;
+    mutable Stats metrics;
+
+    // Evaluations of a cached program before it is compiled to native code,
+    // and the most inputs a single-row native call binds on the stack
+    static constexpr std::uint32_t JIT_THRESHOLD = 64;
+    static constexpr size_t JIT_MAX_INPUTS = 16;
+
+    // Stack slots execute() keeps on the native stack; only deeper
+    // programs use the per-thread spill buffer
+    static constexpr size_t INLINE_SLOTS = 32;
+
+    // Parallel batches are split into chunks whose inputs and output fit in
+    // a typical per-core L2. Chunk sizes are a multiple of the SIMD block so
+    // every chunk writes its own contiguous, cache-line aligned output range.
+    static constexpr size_t CHUNK_BYTES = 256 * 1024;
+    static constexpr size_t CHUNK_ALIGNMENT = 256;
+
+    struct BatchJob {
+        std::atomic<size_t> nextChunk{0};
+        std::atomic<size_t> finishedChunks{0};
+        std::atomic<bool> failed{false};
+        std::atomic<size_t> failedRows{0};      // Masked batches only
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    // Rejects over-budget input without holding its tokens: first on its
+    // length alone, then as soon as the tokens read so far are too many,
+    // and last on the exact bound once every token is known
+    std::expected<std::vector<Token>, EvalError> tryLex(std::string_view expression) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Lex);
+        if (expression.size() > limits.maxLength) {
+            return std::unexpected(EvalError{EvalErrorCode::TooLong, limits.maxLength});
+        }
+        bool budgeted = limits.maxMemory != static_cast<size_t>(-1);
+        size_t textBound = memoryBound(expression.size(), 0, 0);
+        if (budgeted && textBound > limits.maxMemory) return overBudget(textBound);
+        size_t maxTokens = budgeted ? (limits.maxMemory - expression.size()) / memoryBound(0, 1, 0)
+                                    : static_cast<size_t>(-1);
+        std::vector<Token> tokens;
+        if (std::optional<EvalError> error = Lexer::scan(expression, tokens, limits.maxDepth, maxTokens)) {
+            if (error->code == EvalErrorCode::MemoryBudgetExceeded) {
+                error->required = memoryBound(expression.size(), tokens.size(), 0);
+            }
+            return std::unexpected(*error);
+        }
+        if (budgeted) {
+            size_t required = memoryBound(expression.size(), tokens.size(), operandCount(tokens));
+            if (required > limits.maxMemory) return overBudget(required);
+        }
+        return tokens;
+    }
+
+    static std::unexpected<EvalError> overBudget(size_t required) {
+        return std::unexpected(EvalError{EvalErrorCode::MemoryBudgetExceeded, EvalError::NO_OFFSET, required});
+    }
+
+    static size_t operandCount(std::span<const Token> tokens) {
+        size_t operands = 0;
+        for (const Token& token : tokens) {
+            operands += token.kind == TokenKind::Number || token.kind == TokenKind::Variable;
+        }
+        return operands;
+    }
+
+    std::vector<Token> lex(std::string_view expression) const {
+        std::expected<std::vector<Token>, EvalError> tokens = tryLex(expression);
+        if (!tokens) raise(tokens.error(), expression);
+        return std::move(*tokens);
+    }
+
+    // Throws what the throwing API throws for `error`
+    [[noreturn]] void raise(const EvalError& error, std::string_view expression) const {
+        switch (error.code) {
+            case EvalErrorCode::MemoryBudgetExceeded:
+                throw MemoryBudgetExceeded(error.required, limits.maxMemory);
+            case EvalErrorCode::DivisionByZero:
+                throw std::runtime_error(error.message());
+            default:
+                throw std::invalid_argument(describe(error, expression));
+        }
+    }
+
+    // Translates the token stream into postfix bytecode. `literal` picks the
+    // index of each Push; only typed programs use it.
+    template <typename Literal>
+    std::expected<Program, EvalError> tryCompileTokens(std::string_view expression, const std::vector<Token>& tokens,
+                                                       Literal&& literal) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Compile);
+        Program program;
+        size_t depth = 0;
+        // Slot of each variable name seen so far
+        std::unordered_map<std::string_view, std::uint32_t> slots;
+
+        auto emit = [&](OpCode op, double value = 0, std::uint32_t index = 0) {
+            program.code.push_back({op, index, value});
+            if (op == OpCode::Push || op == OpCode::Load) {
+                depth++;
+                if (depth > program.maxDepth) program.maxDepth = depth;
+            } else if (op != OpCode::Neg) {
+                depth--;
+            }
+        };
+
+        std::optional<EvalError> error = Parser::tryToPostfix(tokens, [&](OpCode op, const Token& token) {
+            switch (op) {
+                case OpCode::Push:
+                    emit(OpCode::Push, token.value, literal(token));
+                    break;
+                case OpCode::Load: {
+                    std::string_view name = expression.substr(token.offset, token.length);
+                    auto [it, added] = slots.try_emplace(name, static_cast<std::uint32_t>(program.variables.size()));
+                    if (added) program.variables.emplace_back(name);
+                    emit(OpCode::Load, 0, it->second);
+                    break;
+                }
+                default:
+                    emit(op);
+                    break;
+            }
+        }, limits.maxDepth);
+        if (error) return std::unexpected(*error);
+        metrics.attachProfile(program);
+        return program;
+    }
+
+    std::expected<Program, EvalError> tryCompileTokens(std::string_view expression,
+                                                       const std::vector<Token>& tokens) const {
+        return tryCompileTokens(expression, tokens, [](const Token&) { return std::uint32_t{0}; });
+    }
+
+    template <typename Literal>
+    Program compileTokens(std::string_view expression, const std::vector<Token>& tokens, Literal&& literal) const {
+        std::expected<Program, EvalError> program = tryCompileTokens(expression, tokens, literal);
+        if (!program) raise(program.error(), expression);
+        return std::move(*program);
+    }
+
+    Program compileTokens(std::string_view expression, const std::vector<Token>& tokens) const {
+        return compileTokens(expression, tokens, [](const Token&) { return std::uint32_t{0}; });
+    }
+
+    void checkBatch(const Program& program, std::span<const std::span<const double>> columns,
+                    std::span<double> out) const {
+        checkInputs(program, columns.size());
+        for (const auto& column : columns) {
+            if (column.size() < out.size()) {
+                throw std::invalid_argument("Input column shorter than output");
+            }
+        }
+    }
+
+    void checkBatch(const Program& program, std::span<const std::span<const double>> columns,
+                    std::span<double> out, std::span<const std::uint8_t> failed) const {
+        checkBatch(program, columns, out);
+        if (failed.size() < out.size()) throw std::invalid_argument("Error mask shorter than output");
+    }
+
+    static size_t chunkRows(const Program& program) {
+        size_t bytesPerRow = (program.variables.size() + 1) * sizeof(double);
+        size_t rows = CHUNK_BYTES / bytesPerRow / CHUNK_ALIGNMENT * CHUNK_ALIGNMENT;
+        return std::max(rows, CHUNK_ALIGNMENT);
+    }
+
+    // Claims chunks until none are left. Both the caller and the helper
+    // tasks run this, so progress never depends on a helper being scheduled.
+    // With a `failed` mask rows are masked instead of failing the batch.
+    static void drainChunks(const std::shared_ptr<BatchJob>& job, const Program* program,
+                            const JitProgram* native, std::span<const std::span<const double>> columns,
+                            std::span<double> out, std::uint8_t* failed, size_t rowsPerChunk, size_t chunkCount) {
+        size_t chunk;
+        while ((chunk = job->nextChunk.fetch_add(1)) < chunkCount) {
+            if (!job->failed.load(std::memory_order_relaxed)) {
+                size_t begin = chunk * rowsPerChunk;
+                size_t end = std::min(begin + rowsPerChunk, out.size());
+                try {
+                    if (failed) {
+                        job->failedRows += runRowsMasked(*program, native, columns, begin, end,
+                                                         out.data() + begin, failed + begin);
+                    } else {
+                        runRows(*program, native, columns, begin, end, out.data() + begin);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(job->errorMutex);
+                    if (!job->error) job->error = std::current_exception();
+                    job->failed = true;
+                }
+            }
+            if (job->finishedChunks.fetch_add(1) + 1 == chunkCount) {
+                job->finishedChunks.notify_all();
+            }
+        }
+    }
+
+    // Splits a checked batch into chunks run by the caller and up to
+    // `concurrency` helpers. Returns the failed rows of a masked batch.
+    size_t runChunks(const Program& program, std::span<const std::span<const double>> columns,
+                     std::span<double> out, std::uint8_t* failed, const Executor& executor,
+                     size_t concurrency) const {
+        const JitProgram* native = nativeCode(program);
+        size_t rowsPerChunk = chunkRows(program);
+        size_t chunkCount = (out.size() + rowsPerChunk - 1) / rowsPerChunk;
+        if (chunkCount <= 1 || concurrency == 0) {
+            if (failed) return runRowsMasked(program, native, columns, 0, out.size(), out.data(), failed);
+            runRows(program, native, columns, 0, out.size(), out.data());
+            return 0;
+        }
+
+        // Helpers hold the job alive and share the caller's program, which
+        // outlives every chunk; one that starts after the batch is finished
+        // finds no chunk left and never touches the program or the inputs
+        auto job = std::make_shared<BatchJob>();
+        const Program* shared = &program;
+        size_t helpers = std::min(concurrency, chunkCount - 1);
+        for (size_t i = 0; i < helpers; i++) {
+            executor([=] { drainChunks(job, shared, native, columns, out, failed, rowsPerChunk, chunkCount); });
+        }
+        drainChunks(job, shared, native, columns, out, failed, rowsPerChunk, chunkCount);
+
+        size_t finished;
+        while ((finished = job->finishedChunks.load()) < chunkCount) {
+            job->finishedChunks.wait(finished);
+        }
+        if (job->error) std::rethrow_exception(job->error);
+        return job->failedRows;
+    }
+
+    // Cached programs get fused interpreter code, and count their
+    // evaluations towards native compilation
+    static void attachTiers(Program& program) {
+        program.fused = Fusion::fuse(program);
+#if CALC_ENABLE_JIT
+        program.tier = std::make_shared<JitTier>();
+#endif
+    }
+
+    // Native code for a hot cached program, counting this evaluation
+    // towards the threshold; null while the program stays interpreted
+    static const JitProgram* nativeCode([[maybe_unused]] const Program& program) {
+#if CALC_ENABLE_JIT
+        if (program.tier) return program.tier->hot(program, JIT_THRESHOLD);
+#endif
+        return nullptr;
+    }
+
+    // Returns the rows written; fewer than asked when a row divides by zero
+    static size_t runRowsUntilError(const Program& program, [[maybe_unused]] const JitProgram* native,
+                                    std::span<const std::span<const double>> columns,
+                                    size_t begin, size_t end, double* out) {
+#if CALC_ENABLE_JIT
+        if (native) return native->runUntilError(columns, begin, end, out);
+#endif
+        if (!SimdEvaluator::fits(program)) return runRowsScalar(program, columns, begin, end, out);
+        return SimdEvaluator::runUntilError(program, columns, begin, end, out);
+    }
+
+    // Row-wise batch for programs with too many temporaries for the SIMD
+    // scratch; the interpreter gives the same bits
+    static size_t runRowsScalar(const Program& program, std::span<const std::span<const double>> columns,
+                                size_t begin, size_t end, double* out) {
+        static thread_local std::vector<double> inputs;
+        inputs.resize(columns.size());
+        for (size_t row = begin; row < end; row++) {
+            for (size_t i = 0; i < columns.size(); i++) inputs[i] = columns[i][row];
+            bool ok = program.fused ? interpret<false>(*program.fused, inputs, nullptr, out[row - begin])
+                                    : interpret<false>(program, inputs, nullptr, out[row - begin]);
+            if (!ok) return row - begin;
+        }
+        return end - begin;
+    }
+
+    static void runRows(const Program& program, const JitProgram* native,
+                        std::span<const std::span<const double>> columns,
+                        size_t begin, size_t end, double* out) {
+        if (runRowsUntilError(program, native, columns, begin, end, out) != end - begin) {
+            throw std::runtime_error("Division by zero");
+        }
+    }
+
+    // Rows that divide by zero get NaN and a 1 in `failed`, the rest a 0.
+    // The fast paths stop short of a failing row; the rows from there to
+    // the failure are redone one at a time, then the fast path resumes.
+    // Returns the failed rows.
+    static size_t runRowsMasked(const Program& program, const JitProgram* native,
+                                std::span<const std::span<const double>> columns,
+                                size_t begin, size_t end, double* out, std::uint8_t* failed) {
+        static thread_local std::vector<double> inputs;
+        inputs.resize(columns.size());
+        size_t failedRows = 0;
+        size_t row = begin;
+        while (row < end) {
+            size_t written = runRowsUntilError(program, native, columns, row, end, out + (row - begin));
+            std::fill_n(failed + (row - begin), written, std::uint8_t{0});
+            row += written;
+
+            bool stopped = false;
+            for (; row < end && !stopped; row++) {
+                for (size_t i = 0; i < columns.size(); i++) inputs[i] = columns[i][row];
+                double result;
+                stopped = !interpret<false>(program, inputs, nullptr, result);
+                out[row - begin] = stopped ? std::numeric_limits<double>::quiet_NaN() : result;
+                failed[row - begin] = stopped;
+            }
+            failedRows += stopped;
+        }
+        return failedRows;
+    }
+
+    // One row with inputs already checked; false if it divides by zero
+    static bool runChecked(const Program& program, std::span<const double> inputs, double& result) {
+#if CALC_ENABLE_JIT
+        if (inputs.size() <= JIT_MAX_INPUTS) {
+            if (const JitProgram* jit = nativeCode(program)) {
+                const double* bound[JIT_MAX_INPUTS];
+                for (size_t i = 0; i < inputs.size(); i++) bound[i] = &inputs[i];
+                return jit->function()(bound, &result, 1) == 1;
+            }
+        }
+#endif
+        if (program.fused) return interpret<false>(*program.fused, inputs, nullptr, result);
+        return interpret<false>(program, inputs, nullptr, result);
+    }
+
+    double runSingle(const Program& program, std::span<const double> inputs) const {
+        checkInputs(program, inputs.size());
+        double result;
+        if (!runChecked(program, inputs, result)) throw std::runtime_error("Division by zero");
+        return result;
+    }
+
+    void checkInputs(const Program& program, size_t count) const {
+        if (count < program.variables.size()) {
+            throw std::invalid_argument("Unbound variable: " + program.variables[count]);
+        }
+        if (count > program.variables.size()) {
+            throw std::invalid_argument("Too many inputs");
+        }
+    }
+
+    void checkInputs(const ProgramView& program, size_t count) const {
+        if (count < program.variableCount()) {
+            throw std::invalid_argument("Unbound variable: " + std::string(program.variable(count)));
+        }
+        if (count > program.variableCount()) {
+            throw std::invalid_argument("Too many inputs");
+        }
+    }
+
+    // Value stack and temporaries of programs too large for the inline
+    // slots of execute(); grown per thread and reused
+    static double* spillSlots(size_t count) {
+        static thread_local std::vector<double> storage;
+        if (storage.size() < count) storage.resize(count);
+        return storage.data();
+    }
+
+    // With Trace off the loop carries no tracing code at all; with it on each
+    // operation appends one StepRecord to `context`. Runs a Program, its
+    // FusedCode or a ProgramView on inputs already checked against it, and
+    // stops with false at a division by zero.
+    template <bool Trace, typename Code>
+    static bool interpret(const Code& program, std::span<const double> inputs, EvalContext* context,
+                          double& result) {
+        double inlineSlots[INLINE_SLOTS];
+        size_t slotCount = program.maxDepth + program.tempCount;
+        double* values = slotCount <= INLINE_SLOTS ? inlineSlots : spillSlots(slotCount);
+        double* temps = values + program.maxDepth;
+        size_t top = 0;
+
+        for (const Instruction& instr : program.code) {
+            switch (instr.op) {
+                case OpCode::Push:
+                    values[top++] = instr.value;
+                    break;
+                case OpCode::Load:
+                    values[top++] = inputs[instr.index];
+                    break;
+                case OpCode::StoreTemp:
+                    temps[instr.index] = values[top - 1];
+                    break;
+                case OpCode::LoadTemp:
+                    values[top++] = temps[instr.index];
+                    break;
+                case OpCode::Neg: {
+                    double a = values[top - 1];
+                    values[top - 1] = -a;
+
+                    if constexpr (Trace) {
+                        context->recordPrefix(Operators::symbol(instr.op), a, values[top - 1]);
+                    }
+                    break;
+                }
+                // Superinstructions; the tracing path runs unfused code
+                case OpCode::MulAdd:
+                    top -= 2;
+                    values[top - 1] = values[top - 1] * values[top] + values[top + 1];
+                    break;
+                case OpCode::AddMul:
+                    top -= 2;
+                    values[top - 1] = values[top - 1] + values[top] * values[top + 1];
+                    break;
+                case OpCode::Square:
+                    values[top - 1] *= values[top - 1];
+                    break;
+                case OpCode::Cube: {
+                    double x = values[top - 1];
+                    values[top - 1] = x * x * x;
+                    break;
+                }
+                case OpCode::Sum: {
+                    top -= instr.index - 1;
+                    double sum = values[top - 1];
+                    for (std::uint32_t i = 1; i < instr.index; i++) sum += values[top - 1 + i];
+                    values[top - 1] = sum;
+                    break;
+                }
+                default: {
+                    double b = values[--top];
+                    double a = values[top - 1];
+                    if (b == 0 && (instr.op == OpCode::Div || instr.op == OpCode::Mod)) return false;
+                    values[top - 1] = applyOperation(a, b, instr.op);
+
+                    if constexpr (Trace) {
+                        context->record(Operators::symbol(instr.op), a, b, values[top - 1]);
+                    }
+                    break;
+                }
+            }
+        }
+        result = values[0];
+        return true;
+    }
+
+    template <bool Trace, typename Code>
+    double execute(const Code& program, std::span<const double> inputs, EvalContext* context) const {
+        checkInputs(program, inputs.size());
+        double result;
+        if (!interpret<Trace>(program, inputs, context, result)) throw std::runtime_error("Division by zero");
+        return result;
+    }
+
+public:
+    explicit Calculator(size_t cacheCapacity = DEFAULT_CACHE_CAPACITY, InputLimits limits = {})
+        : limits(limits), cache(cacheCapacity) {}
+
+    explicit Calculator(InputLimits limits) : Calculator(DEFAULT_CACHE_CAPACITY, limits) {}
+
+    // Diagnostic dump of the tokens an expression lexes into. Evaluation
+    // itself never writes anywhere; callers that want this output ask for it.
+    void inspect(std::string_view expression, std::ostream& os = std::cout) const {
+        std::vector<Token> tokens = Lexer::tokenize(expression);
+
+        os << "\nToken Matches:\n";
+        os << "Numbers found:\n";
+        for (const Token& token : tokens) {
+            if (token.kind == TokenKind::Number) {
+                os << "  - " << expression.substr(token.offset, token.length) << '\n';
+            }
+        }
+
+        os << "Variables found:\n";
+        for (const Token& token : tokens) {
+            if (token.kind == TokenKind::Variable) {
+                os << "  - " << expression.substr(token.offset, token.length) << '\n';
+            }
+        }
+
+        os << "Operators found:\n";
+        for (const Token& token : tokens) {
+            if (token.kind == TokenKind::Operator) {
+                os << "  - " << token.symbol << '\n';
+            }
+        }
+
+        os << "Parentheses/Braces found:\n";
+        for (const Token& token : tokens) {
+            if (token.kind == TokenKind::OpenBracket || token.kind == TokenKind::CloseBracket) {
+                os << " " << token.symbol << " ";
+            }
+        }
+        os << std::endl;
+    }
+
+    void validateExpression(std::string_view expression) const {
+        lex(expression);
+    }
+
+    // Most memory compiling and running one row of the expression can take;
+    // InputLimits::maxMemory is checked against this
+    size_t requiredMemory(std::string_view expression) const {
+        std::vector<Token> tokens = Lexer::tokenize(expression, limits.maxDepth);
+        return memoryBound(expression.size(), tokens.size(), operandCount(tokens));
+    }
+
+    // Upper bound on the bytes compiling, optimizing and running one row of
+    // `bytes` of text with `tokens` tokens, `operands` of them numbers or
+    // variables, allocate. Every token is at most one instruction and one
+    // optimizer node, operands bound the stack and its temporaries, and
+    // vectors may hold twice what they use while growing. Fewer tokens or
+    // operands give a lower bound.
+    static constexpr size_t memoryBound(size_t bytes, size_t tokens, size_t operands) {
+        size_t compiled = 2 * tokens * sizeof(Instruction);
+        size_t names = bytes + operands * (sizeof(std::string) + 4 * sizeof(void*));
+        return 2 * tokens * sizeof(Token) + 2 * compiled + names +
+               2 * tokens * Optimizer::BYTES_PER_INSTRUCTION + 2 * operands * sizeof(double);
+    }
+
+    const InputLimits& inputLimits() const {
+        return limits;
+    }
+
+    // Parses and validates an expression once into reusable bytecode
+    Program compile(std::string_view expression) const {
+        return compileTokens(expression, lex(expression));
+    }
+
+    // Folds constants, applies safe algebraic identities and shares common
+    // subexpressions. The result computes the same values and raises the
+    // same errors as the input program, with the same variable slots.
+    Program optimize(const Program& program) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Optimize);
+        Program optimized = Optimizer().optimize(program);
+        metrics.attachProfile(optimized);
+        return optimized;
+    }
+
+    // Returns the optimized program for an expression, compiling and caching
+    // it on first use. Repeated formulas skip the lexer and compiler.
+    std::shared_ptr<const Program> compileCached(std::string_view expression) const {
+        return cache.getOrCompile(expression, [this](std::string_view text) {
+            Program program = optimize(compile(text));
+            attachTiers(program);
+            return program;
+        });
+    }
+
+    // Hit, miss and eviction counters of the compiled-program cache
+    CacheStats cacheStats() const {
+        return cache.stats();
+    }
+
+    // Phase latencies, operation counts and cache counters. All zero unless
+    // built with CALC_ENABLE_STATS; snapshot.enabled tells which.
+    StatsSnapshot stats() const {
+        StatsSnapshot snapshot = metrics.snapshot();
+        snapshot.cache = cache.stats();
+        return snapshot;
+    }
+
+    void clearStats() const {
+        metrics.clear();
+    }
+
+    // Appends a result as text, timed as the Format phase
+    void formatResult(std::string& text, double value) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Format);
+        appendNumber(text, value);
+    }
+
+    // Evaluates a compiled program without touching any strings. `inputs`
+    // binds one value per entry of program.variables, in slot order.
+    // Programs from compileCached() switch to native code once hot.
+    double run(const Program& program, std::span<const double> inputs = {}) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Execute);
+        metrics.countRuns(program, 1);
+        return runSingle(program, inputs);
+    }
+
+    // Runs a program straight from a mapped program file, on the
+    // interpreter; view.toProgram() opens the batch and native paths
+    double run(const ProgramView& program, std::span<const double> inputs = {}) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Execute);
+        metrics.countRuns(program.code, 1);
+        return execute<false>(program, inputs, nullptr);
+    }
+
+    // Evaluates the program once per row over struct-of-arrays input: one
+    // column per variable slot, each at least out.size() rows long.
+    void evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                       std::span<double> out) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Batch);
+        checkBatch(program, columns, out);
+        metrics.countRuns(program, out.size());
+        runRows(program, nativeCode(program), columns, 0, out.size(), out.data());
+    }
+
+    // Parallel batch evaluation on the library's work-stealing pool
+    void evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                       std::span<double> out, ThreadPool& pool) const {
+        evaluateBatch(program, columns, out, pool.executor(), pool.size());
+    }
+
+    // Parallel batch evaluation on a caller-supplied executor. At most
+    // `concurrency` helper tasks are handed to it; the calling thread works
+    // on chunks too and returns once every row has been written.
+    void evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                       std::span<double> out, const Executor& executor, size_t concurrency) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Batch);
+        checkBatch(program, columns, out);
+        metrics.countRuns(program, out.size());
+        runChunks(program, columns, out, nullptr, executor, concurrency);
+    }
+
+    // evaluateBatch() that does not stop at a row dividing by zero: that
+    // row's output is NaN and its entry of `failed` is 1, every other
+    // entry 0. Returns the number of failed rows. Columns that do not fit
+    // the program still throw.
+    size_t evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                         std::span<double> out, std::span<std::uint8_t> failed) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Batch);
+        checkBatch(program, columns, out, failed);
+        metrics.countRuns(program, out.size());
+        return runRowsMasked(program, nativeCode(program), columns, 0, out.size(), out.data(), failed.data());
+    }
+
+    size_t evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                         std::span<double> out, std::span<std::uint8_t> failed, ThreadPool& pool) const {
+        return evaluateBatch(program, columns, out, failed, pool.executor(), pool.size());
+    }
+
+    size_t evaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                         std::span<double> out, std::span<std::uint8_t> failed, const Executor& executor,
+                         size_t concurrency) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Batch);
+        checkBatch(program, columns, out, failed);
+        metrics.countRuns(program, out.size());
+        return runChunks(program, columns, out, failed.data(), executor, concurrency);
+    }
+
+    double evaluate(std::string_view expression) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Evaluate);
+        const std::shared_ptr<const Program> program = compileCached(expression);
+        metrics.countRuns(*program, 1);
+        return runSingle(*program, {});
+    }
+
+    // Non-throwing compileCached(). Malformed input is reported, with the
+    // byte it was found at, without raising an exception.
+    std::expected<std::shared_ptr<const Program>, EvalError> tryCompileCached(std::string_view expression) const {
+        if (std::shared_ptr<const Program> program = cache.find(expression)) return program;
+        std::expected<std::vector<Token>, EvalError> tokens = tryLex(expression);
+        if (!tokens) return std::unexpected(tokens.error());
+        std::expected<Program, EvalError> compiled = tryCompileTokens(expression, *tokens);
+        if (!compiled) return std::unexpected(compiled.error());
+        Program optimized = optimize(*compiled);
+        attachTiers(optimized);
+        return cache.insert(expression, std::make_shared<const Program>(std::move(optimized)));
+    }
+
+    // Non-throwing run(). Binding errors carry no offset.
+    std::expected<double, EvalError> tryRun(const Program& program, std::span<const double> inputs = {}) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Execute);
+        if (inputs.size() < program.variables.size()) return std::unexpected(EvalError{EvalErrorCode::UnboundVariable});
+        if (inputs.size() > program.variables.size()) return std::unexpected(EvalError{EvalErrorCode::TooManyInputs});
+        metrics.countRuns(program, 1);
+        double result;
+        if (!runChecked(program, inputs, result)) return std::unexpected(EvalError{EvalErrorCode::DivisionByZero});
+        return result;
+    }
+
+    // Non-throwing evaluate(): every error evaluate() would throw comes
+    // back as an EvalError instead, so malformed input costs no unwinding.
+    // Only allocation failure still throws. describe() gives the message
+    // evaluate() would have thrown.
+    std::expected<double, EvalError> tryEvaluate(std::string_view expression) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Evaluate);
+        std::expected<std::shared_ptr<const Program>, EvalError> program = tryCompileCached(expression);
+        if (!program) return std::unexpected(program.error());
+        const Program& code = **program;
+        if (!code.variables.empty()) {
+            // Slot 0 is the first identifier in the text, so the first match is it
+            return std::unexpected(EvalError{EvalErrorCode::UnboundVariable, expression.find(code.variables[0])});
+        }
+        metrics.countRuns(code, 1);
+        double result;
+        if (!runChecked(code, {}, result)) return std::unexpected(EvalError{EvalErrorCode::DivisionByZero});
+        return result;
+    }
+
+    // The exception message the throwing API gives for `error`
+    std::string describe(const EvalError& error, std::string_view expression) const {
+        switch (error.code) {
+            case EvalErrorCode::MemoryBudgetExceeded:
+                return MemoryBudgetExceeded(error.required, limits.maxMemory).what();
+            case EvalErrorCode::UnboundVariable: {
+                if (error.offset >= expression.size()) return error.message();
+                size_t end = error.offset;
+                while (end < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[end])) ||
+                                                   expression[end] == '_')) {
+                    end++;
+                }
+                return std::string(error.message()) + ": " +
+                       std::string(expression.substr(error.offset, end - error.offset));
+            }
+            default:
+                return error.message();
+        }
+    }
+
+    // Compiles for a policy number type from numeric.h. Literals are parsed
+    // from their source text by the type, and the program is not optimized
+    // because the optimizer folds constants in double.
+    template <typename T>
+    TypedProgram<T> compileAs(std::string_view expression) const {
+        TypedProgram<T> typed;
+        std::vector<Token> tokens = lex(expression);
+        typed.program = compileTokens(expression, tokens, [&](const Token& token) {
+            typed.literals.push_back(NumericPolicy<T>::parse(expression.substr(token.offset, token.length)));
+            return static_cast<std::uint32_t>(typed.literals.size() - 1);
+        });
+        return typed;
+    }
+
+    // Runs a typed program with the type's own operator semantics
+    template <typename T>
+    T run(const TypedProgram<T>& typed, std::span<const T> inputs = {}) const {
+        const Program& program = typed.program;
+        checkInputs(program, inputs.size());
+        static thread_local std::vector<T> storage;
+        size_t slotCount = program.maxDepth + program.tempCount;
+        if (storage.size() < slotCount) storage.resize(slotCount);
+        T* values = storage.data();
+        T* temps = values + program.maxDepth;
+        size_t top = 0;
+
+        for (const Instruction& instr : program.code) {
+            switch (instr.op) {
+                case OpCode::Push:
+                    values[top++] = typed.literals[instr.index];
+                    break;
+                case OpCode::Load:
+                    values[top++] = inputs[instr.index];
+                    break;
+                case OpCode::StoreTemp:
+                    temps[instr.index] = values[top - 1];
+                    break;
+                case OpCode::LoadTemp:
+                    values[top++] = temps[instr.index];
+                    break;
+                case OpCode::Neg:
+                    values[top - 1] = -values[top - 1];
+                    break;
+                default:
+                    top--;
+                    values[top - 1] = applyOperation(values[top - 1], values[top], instr.op);
+                    break;
+            }
+        }
+        return values[0];
+    }
+
+    template <typename T>
+    T evaluateAs(std::string_view expression) const {
+        return run(compileAs<T>(expression));
+    }
+
+    // Awaitable evaluate(). A cached formula completes without suspending.
+    // A new one is lexed, compiled and optimized as separate steps, yielding
+    // to options.executor and checking options after each, so a giant
+    // expression gives way to other work and stops early when cancelled or
+    // past its deadline with EvaluationCancelled or DeadlineExceeded. Only
+    // the step boundaries are checked; a lex or run in progress finishes
+    // first. The Calculator must outlive the task.
+    Task<double> asyncEvaluate(std::string expression, AsyncOptions options = {}) const {
+        options.checkpoint();
+        std::shared_ptr<const Program> program = cache.find(expression);
+        if (!program) {
+            std::vector<Token> tokens = lex(expression);
+            co_await resumeOn(options.executor);
+            options.checkpoint();
+
+            Program compiled = compileTokens(expression, tokens);
+            co_await resumeOn(options.executor);
+            options.checkpoint();
+
+            Program optimized = optimize(compiled);
+            attachTiers(optimized);
+            program = cache.insert(expression, std::make_shared<const Program>(std::move(optimized)));
+            co_await resumeOn(options.executor);
+            options.checkpoint();
+        }
+        metrics.countRuns(*program, 1);
+        co_return runSingle(*program, {});
+    }
+
+    // Awaitable evaluateBatch(). Rows are evaluated one cache-sized chunk
+    // at a time, yielding to options.executor and checking options between
+    // chunks; rows after a stop are left unwritten. The program and the
+    // spans must stay valid until the task finishes.
+    Task<void> asyncEvaluateBatch(const Program& program, std::span<const std::span<const double>> columns,
+                                  std::span<double> out, AsyncOptions options = {}) const {
+        checkBatch(program, columns, out);
+        metrics.countRuns(program, out.size());
+        const JitProgram* native = nativeCode(program);
+        size_t rowsPerChunk = chunkRows(program);
+        for (size_t begin = 0; begin < out.size(); begin += rowsPerChunk) {
+            if (begin != 0) co_await resumeOn(options.executor);
+            options.checkpoint();
+            size_t end = std::min(begin + rowsPerChunk, out.size());
+            runRows(program, native, columns, begin, end, out.data() + begin);
+        }
+    }
+
+    // Evaluates and records the intermediate steps into `context`, which
+    // keeps its own copy of the expression text
+    double evaluate(std::string_view expression, EvalContext& context) const {
+        [[maybe_unused]] auto timer = metrics.time(Phase::Evaluate);
+        context.begin(expression);
+        Program program = compile(expression);
+        metrics.countRuns(program, 1);
+        context.result = execute<true>(program, {}, &context);
+        return context.result;
+    }
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "lexer.h"
+#include "operations.h"
+#include "parser.h"
+
+// Compile-time evaluation of literal expressions, for formulas fixed in
+// source code:
+//
+//     constexpr double area = calc::eval<"2^(3+1)*{5-2}">();
+//
+// The expression goes through the same lexer and parser as Calculator, so
+// it accepts the same grammar. Syntax errors, mismatched brackets, division
+// by zero and variables fail the build at the throw that reports them. So
+// does a power without an exact result, such as 1.1^2: std::pow is not
+// portably constexpr, and folding it another way could round differently.
+// Powers of zero fold as std::pow gives them, so 0^-1 is infinity, and `%`
+// always folds, with the same bits as std::fmod.
+namespace calc {
+
+// String literal usable as a template argument
+template <size_t N>
+struct FixedString {
+    char text[N]{};
+
+    constexpr FixedString(const char (&literal)[N]) {
+        std::copy(literal, literal + N, text);
+    }
+
+    constexpr std::string_view view() const {
+        return {text, N - 1};
+    }
+};
+
+// Evaluates an expression without variables. Also callable at run time,
+// where it throws like Calculator::evaluate().
+constexpr double evaluate(std::string_view expression) {
+    std::vector<Token> tokens = Lexer::tokenize(expression);
+    std::vector<double> values;
+    Parser::toPostfix(tokens, [&](OpCode op, const Token& token) {
+        switch (op) {
+            case OpCode::Push:
+                values.push_back(token.value);
+                break;
+            case OpCode::Load:
+                throw std::invalid_argument("Unbound variable");
+            case OpCode::Neg:
+                values.back() = -values.back();
+                break;
+            default: {
+                double b = values.back();
+                values.pop_back();
+                values.back() = applyOperation(values.back(), b, op);
+                break;
+            }
+        }
+    });
+    return values.back();
+}
+
+template <FixedString Expression>
+consteval double eval() {
+    return evaluate(Expression.view());
+}
+
+}
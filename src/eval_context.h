@@ -0,0 +1,105 @@
+#pragma once
+
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "format.h"
+
+// One operation performed during a traced evaluation. A prefix operation
+// has only the operand `a`.
+struct StepRecord {
+    char op;
+    bool prefix;
+    double a;
+    double b;
+    double result;
+
+    bool operator==(const StepRecord&) const = default;
+};
+
+// Per-call evaluation state. A Calculator holds no mutable state, so one
+// instance can be shared across threads with each call owning a context.
+// Passing a context turns tracing on; the trace is kept as compact records
+// and only rendered to text when the steps are requested.
+class EvalContext {
+private:
+    friend class Calculator;
+
+    std::string expression;
+    std::vector<StepRecord> records;
+    double result = 0;
+
+    void begin(std::string_view expr) {
+        expression.assign(expr);
+        records.clear();
+        result = 0;
+    }
+
+    void record(char op, double a, double b, double value) {
+        add({op, false, a, b, value});
+    }
+
+    void recordPrefix(char op, double a, double value) {
+        add({op, true, a, 0, value});
+    }
+
+    void add(const StepRecord& step) {
+        if (records.empty() || !(records.back() == step)) {
+            records.push_back(step);
+        }
+    }
+
+public:
+    const std::vector<StepRecord>& getRecords() const {
+        return records;
+    }
+
+    void clear() {
+        begin({});
+    }
+
+    // Renders the trace: the expression, one line per operation, the result
+    std::vector<std::string> getSteps() const {
+        std::vector<std::string> steps;
+        auto addStep = [&](std::string step) {
+            // Only add the step if it's different from the last one
+            if (steps.empty() || steps.back() != step) {
+                steps.push_back(std::move(step));
+            }
+        };
+
+        addStep(expression);
+        for (const StepRecord& step : records) {
+            std::string text;
+            if (step.prefix) {
+                text += step.op;
+                text += '(';
+                appendNumber(text, step.a);
+                text += ") = ";
+            } else {
+                appendNumber(text, step.a);
+                text += ' ';
+                text += step.op;
+                text += ' ';
+                appendNumber(text, step.b);
+                text += " = ";
+            }
+            appendNumber(text, step.result);
+            addStep(std::move(text));
+        }
+        addStep(formatNumber(result));
+        return steps;
+    }
+
+    void printSteps(std::ostream& os = std::cout) const {
+        std::vector<std::string> steps = getSteps();
+        os << "\nEvaluation Steps:\n";
+        for (size_t i = 0; i < steps.size(); i++) {
+            os << i + 1 << ". " << steps[i] << '\n';
+        }
+        os.flush();
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Why an expression failed, for the non-throwing API. Each code matches
+// one of the exceptions the throwing API raises for the same input.
+enum class EvalErrorCode : std::uint8_t {
+    InvalidFormat,
+    MismatchedBrackets,
+    UnclosedBrackets,
+    TooLong,
+    NestedTooDeeply,
+    MemoryBudgetExceeded,
+    UnboundVariable,
+    TooManyInputs,
+    DivisionByZero,
+};
+
+struct EvalError {
+    static constexpr size_t NO_OFFSET = static_cast<size_t>(-1);
+
+    EvalErrorCode code;
+    size_t offset = NO_OFFSET;      // Byte of the expression at fault; none for errors found while running
+    size_t required = 0;            // MemoryBudgetExceeded only: bytes the expression was found to need
+
+    // The exception message for the code, without any detail
+    constexpr const char* message() const {
+        switch (code) {
+            case EvalErrorCode::InvalidFormat: return "Invalid expression format";
+            case EvalErrorCode::MismatchedBrackets: return "Mismatched brackets";
+            case EvalErrorCode::UnclosedBrackets: return "Unclosed brackets";
+            case EvalErrorCode::TooLong: return "Expression too long";
+            case EvalErrorCode::NestedTooDeeply: return "Expression nested too deeply";
+            case EvalErrorCode::MemoryBudgetExceeded: return "Memory budget exceeded";
+            case EvalErrorCode::UnboundVariable: return "Unbound variable";
+            case EvalErrorCode::TooManyInputs: return "Too many inputs";
+            case EvalErrorCode::DivisionByZero: return "Division by zero";
+        }
+        return "Invalid expression format";
+    }
+
+    friend constexpr bool operator==(const EvalError&, const EvalError&) = default;
+};
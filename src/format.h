@@ -0,0 +1,27 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <string>
+
+// Room for the longest text formatNumber() can produce
+inline constexpr size_t NUMBER_BUFFER_SIZE = 32;
+
+// Writes the shortest text that parses back to exactly the same double
+// into [first, last) and returns one past its end. Needs at most
+// NUMBER_BUFFER_SIZE characters.
+inline char* formatNumber(double num, char* first, char* last) {
+    return std::to_chars(first, last, num).ptr;
+}
+
+// Appends formatNumber() text to `out` without a temporary string
+inline void appendNumber(std::string& out, double num) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    out.append(buffer, formatNumber(num, buffer, buffer + sizeof(buffer)));
+}
+
+inline std::string formatNumber(double num) {
+    std::string text;
+    appendNumber(text, num);
+    return text;
+}
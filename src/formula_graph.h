@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "calculator.h"
+#include "program.h"
+#include "thread_pool.h"
+
+// Named cells whose formulas refer to other cells by name, like a
+// spreadsheet. Cells form a DAG; a formula that would close a cycle is
+// rejected. Changing a cell marks it and everything downstream dirty, and
+// recompute() re-evaluates only those cells, one topological level at a
+// time, with wide levels split across the thread pool.
+//
+// A cell that fails to evaluate keeps its error, and so does every cell
+// that depends on it; value() rethrows it. A name used before it is
+// defined is an empty cell that fails as an unbound variable. The graph
+// itself is not thread-safe: one thread edits and recomputes it.
+class FormulaGraph {
+private:
+    // Cells per parallel task, and the smallest level worth splitting
+    static constexpr size_t CELLS_PER_TASK = 256;
+    static constexpr size_t PARALLEL_CELLS = 2 * CELLS_PER_TASK;
+
+    struct Cell {
+        std::string name;
+        std::shared_ptr<const Program> program;     // Null for a plain value
+        std::vector<size_t> inputs;                 // Cell of each variable slot
+        std::vector<size_t> dependents;
+        double value = 0;
+        std::exception_ptr error;
+        bool defined = false;
+        bool dirty = false;
+        size_t pending = 0;         // Dirty inputs not yet recomputed
+    };
+
+    struct LevelJob {
+        std::atomic<size_t> nextChunk{0};
+        std::atomic<size_t> finishedChunks{0};
+    };
+
+    const Calculator& calc;
+    ThreadPool& pool;
+    std::vector<Cell> cells;
+    std::unordered_map<std::string, size_t> index;
+    std::vector<size_t> dirtyCells;
+
+    size_t cellFor(std::string_view name) {
+        auto it = index.find(std::string(name));
+        if (it != index.end()) return it->second;
+        cells.emplace_back();
+        cells.back().name = name;
+        cells.back().error = std::make_exception_ptr(std::invalid_argument("Unbound variable: " + std::string(name)));
+        index.emplace(name, cells.size() - 1);
+        return cells.size() - 1;
+    }
+
+    const Cell& find(std::string_view name) const {
+        auto it = index.find(std::string(name));
+        if (it == index.end()) throw std::invalid_argument("Unknown cell: " + std::string(name));
+        return cells[it->second];
+    }
+
+    // Marks the cell and everything downstream. A dirty cell's dependents
+    // are already dirty, so the walk stops there.
+    void markDirty(size_t start) {
+        std::vector<size_t> stack{start};
+        while (!stack.empty()) {
+            size_t id = stack.back();
+            stack.pop_back();
+            if (cells[id].dirty) continue;
+            cells[id].dirty = true;
+            dirtyCells.push_back(id);
+            for (size_t dependent : cells[id].dependents) stack.push_back(dependent);
+        }
+    }
+
+    // The cell itself and everything downstream of it
+    std::vector<bool> downstreamOf(size_t start) const {
+        std::vector<bool> seen(cells.size());
+        std::vector<size_t> stack{start};
+        while (!stack.empty()) {
+            size_t id = stack.back();
+            stack.pop_back();
+            if (seen[id]) continue;
+            seen[id] = true;
+            for (size_t dependent : cells[id].dependents) stack.push_back(dependent);
+        }
+        return seen;
+    }
+
+    void setInputs(size_t id, std::vector<size_t> inputs) {
+        for (size_t input : cells[id].inputs) std::erase(cells[input].dependents, id);
+        for (size_t input : inputs) cells[input].dependents.push_back(id);
+        cells[id].inputs = std::move(inputs);
+    }
+
+    void evaluate(Cell& cell) const {
+        cell.error = nullptr;
+        if (!cell.program) {
+            if (!cell.defined) {
+                cell.error = std::make_exception_ptr(std::invalid_argument("Unbound variable: " + cell.name));
+            }
+            return;
+        }
+
+        static thread_local std::vector<double> arguments;
+        arguments.clear();
+        for (size_t input : cell.inputs) {
+            if (cells[input].error) {
+                cell.error = cells[input].error;
+                return;
+            }
+            arguments.push_back(cells[input].value);
+        }
+        try {
+            cell.value = calc.run(*cell.program, arguments);
+        } catch (...) {
+            cell.error = std::current_exception();
+        }
+    }
+
+    void drainLevel(LevelJob& job, std::span<const size_t> level, size_t chunkCount) {
+        size_t chunk;
+        while ((chunk = job.nextChunk.fetch_add(1)) < chunkCount) {
+            size_t end = std::min((chunk + 1) * CELLS_PER_TASK, level.size());
+            for (size_t i = chunk * CELLS_PER_TASK; i < end; i++) evaluate(cells[level[i]]);
+            if (job.finishedChunks.fetch_add(1) + 1 == chunkCount) job.finishedChunks.notify_all();
+        }
+    }
+
+    // Cells of one level only read cells of earlier levels, so they can be
+    // evaluated in any order and on any thread
+    void evaluateLevel(std::span<const size_t> level) {
+        size_t chunkCount = (level.size() + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+        if (level.size() < PARALLEL_CELLS || pool.size() <= 1) {
+            for (size_t id : level) evaluate(cells[id]);
+            return;
+        }
+
+        // Helpers that start after the level is done find no chunk left
+        auto job = std::make_shared<LevelJob>();
+        size_t helpers = std::min(pool.size(), chunkCount - 1);
+        for (size_t i = 0; i < helpers; i++) {
+            pool.submit([this, job, level, chunkCount] { drainLevel(*job, level, chunkCount); });
+        }
+        drainLevel(*job, level, chunkCount);
+        size_t finished;
+        while ((finished = job->finishedChunks.load()) < chunkCount) {
+            job->finishedChunks.wait(finished);
+        }
+    }
+
+public:
+    explicit FormulaGraph(const Calculator& calc, ThreadPool& pool = ThreadPool::shared())
+        : calc(calc), pool(pool) {}
+
+    // Defines or replaces a cell's formula. Throws, leaving every formula
+    // as it was, if this one does not compile or would close a cycle.
+    void set(std::string_view name, std::string_view formula) {
+        std::shared_ptr<const Program> program = calc.compileCached(formula);
+        size_t id = cellFor(name);
+        std::vector<size_t> inputs;
+        for (const std::string& variable : program->variables) inputs.push_back(cellFor(variable));
+        std::vector<bool> downstream = downstreamOf(id);
+        for (size_t i = 0; i < inputs.size(); i++) {
+            const std::string& variable = program->variables[i];
+            size_t input = inputs[i];
+            if (input < downstream.size() && downstream[input]) {
+                throw std::invalid_argument("Circular reference: " + std::string(name) + " -> " + variable);
+            }
+        }
+
+        setInputs(id, std::move(inputs));
+        cells[id].program = std::move(program);
+        cells[id].defined = true;
+        markDirty(id);
+    }
+
+    // Makes a cell a plain input value
+    void setValue(std::string_view name, double value) {
+        size_t id = cellFor(name);
+        setInputs(id, {});
+        Cell& cell = cells[id];
+        cell.program = nullptr;
+        cell.defined = true;
+        cell.value = value;
+        cell.error = nullptr;
+        markDirty(id);
+    }
+
+    // Leaves the name as an empty cell; dependents fail until it is set again
+    void erase(std::string_view name) {
+        auto it = index.find(std::string(name));
+        if (it == index.end()) return;
+        size_t id = it->second;
+        setInputs(id, {});
+        cells[id].program = nullptr;
+        cells[id].defined = false;
+        markDirty(id);
+    }
+
+    bool contains(std::string_view name) const {
+        auto it = index.find(std::string(name));
+        return it != index.end() && cells[it->second].defined;
+    }
+
+    // Re-evaluates every dirty cell after all of its inputs
+    void recompute() {
+        if (dirtyCells.empty()) return;
+
+        std::vector<size_t> level;
+        for (size_t id : dirtyCells) {
+            Cell& cell = cells[id];
+            cell.pending = 0;
+            for (size_t input : cell.inputs) cell.pending += cells[input].dirty;
+            if (cell.pending == 0) level.push_back(id);
+        }
+
+        std::vector<size_t> nextLevel;
+        while (!level.empty()) {
+            evaluateLevel(level);
+            nextLevel.clear();
+            for (size_t id : level) {
+                cells[id].dirty = false;
+                for (size_t dependent : cells[id].dependents) {
+                    if (--cells[dependent].pending == 0) nextLevel.push_back(dependent);
+                }
+            }
+            level.swap(nextLevel);
+        }
+        dirtyCells.clear();
+    }
+
+    // Current value of a cell, recomputing first if anything changed.
+    // Rethrows the cell's error.
+    double value(std::string_view name) {
+        recompute();
+        const Cell& cell = find(name);
+        if (cell.error) std::rethrow_exception(cell.error);
+        return cell.value;
+    }
+};
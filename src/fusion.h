@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "program.h"
+
+// Superinstructions: common instruction sequences rewritten into one
+// interpreter dispatch. Each fused opcode rounds exactly like the sequence
+// it replaces, so a fused program gives bit-identical results.
+//   mul_add  a b * c +        ->  a b c MulAdd
+//   add_mul  c a b * +        ->  c a b AddMul
+//   square   x x *            ->  x Square     (also through a temporary)
+//   cube     x x * x *        ->  x Cube
+//   sum      a + b + c + ...  ->  a b c ... Sum
+enum class FusionRule : std::uint8_t {
+    MulAdd,
+    AddMul,
+    Square,
+    Cube,
+    Sum,
+    COUNT
+};
+
+inline constexpr size_t FUSION_RULE_COUNT = static_cast<size_t>(FusionRule::COUNT);
+
+inline const char* fusionRuleName(FusionRule rule) {
+    static const char* const NAMES[FUSION_RULE_COUNT] = {"mul_add", "add_mul", "square", "cube", "sum"};
+    return NAMES[static_cast<size_t>(rule)];
+}
+
+// Interpreter code for a Program, with the fields interpret() reads
+struct FusedCode {
+    std::vector<Instruction> code;
+    size_t maxDepth = 0;
+    size_t tempCount = 0;
+};
+
+// Peephole pass from Program code to FusedCode. Matching is greedy, left
+// to right, and looks at a few instructions at a time.
+class Fusion {
+private:
+    // Operands one Sum adds, bounding how much deeper it makes the stack
+    static constexpr size_t MAX_SUM_OPERANDS = 16;
+
+    struct Match {
+        FusionRule rule = FusionRule::COUNT;
+        size_t length = 0;          // Instructions replaced; 0 when nothing matches
+        size_t replacement = 0;     // Instructions they become
+    };
+
+    static bool isLeaf(const Instruction& instr) {
+        return instr.op == OpCode::Push || instr.op == OpCode::Load || instr.op == OpCode::LoadTemp;
+    }
+
+    static bool sameLeaf(const Instruction& a, const Instruction& b) {
+        return isLeaf(a) && a.op == b.op && a.index == b.index &&
+               std::bit_cast<std::uint64_t>(a.value) == std::bit_cast<std::uint64_t>(b.value);
+    }
+
+    static bool isOp(std::span<const Instruction> code, size_t i, OpCode op) {
+        return i < code.size() && code[i].op == op;
+    }
+
+    static bool isLeafAt(std::span<const Instruction> code, size_t i) {
+        return i < code.size() && isLeaf(code[i]);
+    }
+
+    // The rewrite starting at code[i], preferring the one that saves most
+    static Match match(std::span<const Instruction> code, size_t i) {
+        const Instruction& first = code[i];
+        if (isLeaf(first) && i + 2 < code.size() && sameLeaf(first, code[i + 1]) && isOp(code, i + 2, OpCode::Mul)) {
+            if (i + 4 < code.size() && sameLeaf(first, code[i + 3]) && isOp(code, i + 4, OpCode::Mul)) {
+                return {FusionRule::Cube, 5, 2};
+            }
+            return {FusionRule::Square, 3, 2};
+        }
+        // What the optimizer emits for the square of a shared subexpression
+        if (first.op == OpCode::StoreTemp && isOp(code, i + 1, OpCode::LoadTemp) &&
+            code[i + 1].index == first.index && isOp(code, i + 2, OpCode::Mul)) {
+            return {FusionRule::Square, 3, 2};
+        }
+        if (first.op == OpCode::Mul) {
+            if (isLeafAt(code, i + 1) && isOp(code, i + 2, OpCode::Add)) return {FusionRule::MulAdd, 3, 2};
+            if (isOp(code, i + 1, OpCode::Add)) return {FusionRule::AddMul, 2, 1};
+        }
+
+        // An optional Add, then leaves each followed by an Add
+        size_t lead = first.op == OpCode::Add ? 1 : 0;
+        size_t leaves = 0;
+        while (lead + leaves + 1 < MAX_SUM_OPERANDS && isLeafAt(code, i + lead + 2 * leaves) &&
+               isOp(code, i + lead + 2 * leaves + 1, OpCode::Add)) {
+            leaves++;
+        }
+        if (lead + leaves >= 2) return {FusionRule::Sum, lead + 2 * leaves, leaves + 1};
+        return {};
+    }
+
+    static size_t depthOf(std::span<const Instruction> code) {
+        size_t depth = 0;
+        size_t maxDepth = 0;
+        for (const Instruction& instr : code) {
+            switch (instr.op) {
+                case OpCode::Push:
+                case OpCode::Load:
+                case OpCode::LoadTemp:
+                    maxDepth = std::max(maxDepth, ++depth);
+                    break;
+                case OpCode::StoreTemp:
+                case OpCode::Neg:
+                case OpCode::Square:
+                case OpCode::Cube:
+                    break;
+                case OpCode::MulAdd:
+                case OpCode::AddMul:
+                    depth -= 2;
+                    break;
+                case OpCode::Sum:
+                    depth -= instr.index - 1;
+                    break;
+                default:
+                    depth--;
+                    break;
+            }
+        }
+        return maxDepth;
+    }
+
+public:
+    // Null when no rule applies, so the program runs its own code
+    static std::shared_ptr<const FusedCode> fuse(const Program& program) {
+        std::span<const Instruction> code(program.code);
+        auto fused = std::make_shared<FusedCode>();
+        fused->tempCount = program.tempCount;
+        bool changed = false;
+        for (size_t i = 0; i < code.size();) {
+            Match found = match(code, i);
+            if (found.length == 0) {
+                fused->code.push_back(code[i++]);
+                continue;
+            }
+            changed = true;
+            switch (found.rule) {
+                case FusionRule::MulAdd:
+                    fused->code.push_back(code[i + 1]);
+                    fused->code.push_back({OpCode::MulAdd, 0, 0});
+                    break;
+                case FusionRule::AddMul:
+                    fused->code.push_back({OpCode::AddMul, 0, 0});
+                    break;
+                case FusionRule::Square:
+                case FusionRule::Cube:
+                    fused->code.push_back(code[i]);
+                    fused->code.push_back({found.rule == FusionRule::Square ? OpCode::Square : OpCode::Cube, 0, 0});
+                    break;
+                case FusionRule::Sum: {
+                    size_t lead = code[i].op == OpCode::Add ? 1 : 0;
+                    for (size_t j = i + lead; j < i + found.length; j += 2) fused->code.push_back(code[j]);
+                    fused->code.push_back({OpCode::Sum, static_cast<std::uint32_t>(found.replacement + lead), 0});
+                    break;
+                }
+                case FusionRule::COUNT:
+                    break;
+            }
+            i += found.length;
+        }
+        if (!changed) return nullptr;
+        fused->maxDepth = depthOf(fused->code);
+        return fused;
+    }
+
+    // Dispatches each rule removes from one run of `code`. Allocates
+    // nothing, so profiling can call it on every run.
+    static std::array<std::uint32_t, FUSION_RULE_COUNT> savings(std::span<const Instruction> code) {
+        std::array<std::uint32_t, FUSION_RULE_COUNT> saved{};
+        for (size_t i = 0; i < code.size();) {
+            Match found = match(code, i);
+            if (found.length == 0) {
+                i++;
+                continue;
+            }
+            saved[static_cast<size_t>(found.rule)] += static_cast<std::uint32_t>(found.length - found.replacement);
+            i += found.length;
+        }
+        return saved;
+    }
+};
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "calculator.h"
+#include "lexer.h"
+#include "parser.h"
+#include "program.h"
+
+// An expression kept compiled across in-place edits, for editors that
+// re-evaluate on every keystroke. The text is held as a tree of bracket
+// groups. Each group owns the bytecode of its own tokens, with every child
+// group reduced to a literal holding the child's cached value. An edit
+// relexes and recompiles only the innermost group that contains it, plus
+// any groups the edit itself creates or breaks. Then it reruns the
+// group's ancestors, whose code is unchanged, with the new value.
+//
+// Edits in a small group cost about the size of that group and the code
+// of its enclosing groups, never a rescan of the whole text. While the
+// text does not evaluate, value() reports exactly what
+// Calculator::evaluate() would.
+class IncrementalExpression {
+private:
+    static constexpr size_t NO_CHILD = static_cast<size_t>(-1);
+
+    struct Group {
+        size_t offset = 0;      // First character inside the brackets, relative to the parent's
+        size_t length = 0;      // Characters inside the brackets
+        Group* parent = nullptr;
+        std::vector<std::unique_ptr<Group>> children;   // In text order
+        Program program;        // Own code; each child is one Push literal
+        std::vector<size_t> slots;                      // The Push of each child
+        std::vector<size_t> slotDepths;                 // Parse depth of each child's Push
+        double value = 0;
+        bool failed = false;    // Does not evaluate; value() asks the Calculator why
+
+        // What parsing and budgeting the full text would count, for the
+        // group's own tokens and for its whole subtree: the deepest parse
+        // level in the group's own depths, and tokens and operands with
+        // every placeholder replaced by the child's text
+        size_t ownDepth = 0;
+        size_t ownTokens = 0;
+        size_t ownOperands = 0;
+        size_t depth = 0;
+        size_t tokens = 0;
+        size_t operands = 0;
+
+        // Frees the subtree one group at a time, so deep nesting cannot
+        // overflow the stack the way nested unique_ptr destructors would
+        ~Group() {
+            std::vector<std::unique_ptr<Group>> pending = std::move(children);
+            while (!pending.empty()) {
+                std::unique_ptr<Group> group = std::move(pending.back());
+                pending.pop_back();
+                if (!group) continue;
+                for (auto& child : group->children) pending.push_back(std::move(child));
+            }
+        }
+    };
+
+    struct OpenGroup {
+        Group* group;
+        size_t start;           // Absolute offset of the group's first inner character
+        char closing;
+    };
+
+    const Calculator& calc;
+    std::string source;
+    std::unique_ptr<Group> root;
+    bool broken = true;         // Tree out of date with the text; rebuilt on the next edit
+
+    // Reused between edits
+    std::string flat;
+    std::vector<OpenGroup> open;
+    std::vector<size_t> childOfToken;
+
+    static char closingOf(char c) {
+        return c == '(' ? ')' : c == '{' ? '}' : 0;
+    }
+
+    static bool isClosing(char c) {
+        return c == ')' || c == '}';
+    }
+
+    // Text the limits reject before lexing; no tree is built for it
+    bool textFits() const {
+        const InputLimits& limits = calc.inputLimits();
+        return source.size() <= limits.maxLength &&
+               Calculator::memoryBound(source.size(), 0, 0) <= limits.maxMemory;
+    }
+
+    // Runs a group's code with its children's current values. A child's
+    // inner text parses at the depth of its placeholder, where its own
+    // parse is at depth 2, inside its brackets.
+    void evaluate(Group& group) const {
+        group.failed = !group.program.variables.empty() || group.program.code.empty();
+        group.depth = group.ownDepth;
+        group.tokens = group.ownTokens;
+        group.operands = group.ownOperands;
+        for (size_t i = 0; i < group.children.size() && !group.failed; i++) {
+            const Group& child = *group.children[i];
+            group.failed = child.failed;
+            group.program.code[group.slots[i]].value = child.value;
+            group.depth = std::max(group.depth, group.slotDepths[i] + child.depth - 2);
+            group.tokens += child.tokens;
+            group.operands += child.operands;
+        }
+        // Every group parses at least as deep in the full text
+        group.failed = group.failed || group.depth > calc.inputLimits().maxDepth;
+        if (group.failed) return;
+        try {
+            group.value = calc.run(group.program);
+        } catch (const std::exception&) {
+            group.failed = true;
+        }
+    }
+
+    // Relexes and recompiles a group's own text. Child groups become "(0)"
+    // so the lexer sees the same shape as the full text; a non-root group
+    // is lexed with its brackets for the same reason. Text that does not
+    // compile leaves the group without code, so it alone is failed and the
+    // next edit inside it compiles it again.
+    void compile(Group& group, size_t start) {
+        flat.clear();
+        if (group.parent) flat += source[start - 1];
+        std::vector<size_t> placeholders;
+        size_t pos = start;
+        for (const auto& child : group.children) {
+            size_t childStart = start + child->offset;
+            flat.append(source, pos, childStart - 1 - pos);
+            placeholders.push_back(flat.size() + 1);
+            flat += "(0)";
+            pos = childStart + child->length + 1;
+        }
+        flat.append(source, pos, start + group.length - pos);
+        if (group.parent) flat += source[start + group.length];
+
+        const InputLimits& limits = calc.inputLimits();
+        group.program = Program{};
+        group.slots.assign(group.children.size(), 0);
+        group.slotDepths.assign(group.children.size(), 0);
+        group.ownDepth = 0;
+
+        // No group may hold more tokens than the whole text could
+        std::vector<Token> tokens;
+        size_t maxTokens = limits.maxMemory / Calculator::memoryBound(0, 1, 0);
+        if (Lexer::scan(flat, tokens, static_cast<size_t>(-1), maxTokens)) return;
+        childOfToken.assign(tokens.size(), NO_CHILD);
+        size_t next = 0;
+        for (size_t i = 0; i < tokens.size() && next < placeholders.size(); i++) {
+            if (tokens[i].kind == TokenKind::Number && tokens[i].offset == placeholders[next]) {
+                childOfToken[i] = next++;
+            }
+        }
+
+        Program program;
+        size_t depth = 0;
+        size_t operands = 0;
+        size_t deepest = 0;
+        auto emit = [&](OpCode op, const Token& token, size_t parseDepth) {
+            Instruction instr{op, 0, 0};
+            if (op == OpCode::Push) {
+                instr.value = token.value;
+                size_t child = childOfToken[static_cast<size_t>(&token - tokens.data())];
+                if (child != NO_CHILD) {
+                    group.slots[child] = program.code.size();
+                    group.slotDepths[child] = parseDepth;
+                }
+            } else if (op == OpCode::Load) {
+                // Unbound here; value() reports it with the full text's wording
+                program.variables.emplace_back(flat.substr(token.offset, token.length));
+            }
+            if (op == OpCode::Push || op == OpCode::Load) {
+                program.maxDepth = std::max(program.maxDepth, ++depth);
+                deepest = std::max(deepest, parseDepth);
+                operands++;
+            } else if (op != OpCode::Neg) {
+                depth--;
+            }
+            program.code.push_back(instr);
+        };
+        if (Parser::tryToPostfix(tokens, emit, limits.maxDepth)) return;
+        // Each placeholder is three tokens and one operand of the text
+        // here, and the child's own count has its brackets
+        group.program = std::move(program);
+        group.ownDepth = deepest;
+        group.ownTokens = tokens.size() - 3 * group.children.size();
+        group.ownOperands = operands - group.children.size();
+    }
+
+    // Rebuilds the children of `group` from the text, reusing the subtrees
+    // in `kept`, whose offsets are relative to the group and already
+    // shifted by the edit. Every new group is compiled and evaluated as its
+    // bracket closes, and `group` last. False if the brackets do not match.
+    bool rebuild(Group& group, size_t start, std::vector<std::unique_ptr<Group>> kept) {
+        group.children.clear();
+        open.clear();
+        open.push_back({&group, start, 0});
+        size_t next = 0;
+        size_t pos = start;
+        size_t end = start + group.length;
+        while (pos < end) {
+            OpenGroup& top = open.back();
+            if (next < kept.size() && pos + 1 == start + kept[next]->offset) {
+                Group& child = *kept[next];
+                size_t childStart = start + child.offset;
+                child.offset = childStart - top.start;
+                child.parent = top.group;
+                pos = childStart + child.length + 1;
+                top.group->children.push_back(std::move(kept[next++]));
+                continue;
+            }
+
+            char c = source[pos];
+            if (char closing = closingOf(c)) {
+                auto child = std::make_unique<Group>();
+                child->offset = pos + 1 - top.start;
+                child->parent = top.group;
+                Group* created = child.get();
+                top.group->children.push_back(std::move(child));
+                open.push_back({created, pos + 1, closing});
+            } else if (isClosing(c)) {
+                if (open.size() == 1 || c != top.closing) return false;
+                top.group->length = pos - top.start;
+                Group& closed = *top.group;
+                size_t closedStart = top.start;
+                open.pop_back();
+                compile(closed, closedStart);
+                evaluate(closed);
+            }
+            pos++;
+        }
+        if (open.size() != 1) return false;
+        compile(group, start);
+        evaluate(group);
+        return true;
+    }
+
+    void rebuildAll() {
+        root = std::make_unique<Group>();
+        root->length = source.size();
+        broken = true;
+        if (!textFits()) return;
+        try {
+            broken = !rebuild(*root, 0, {});
+        } catch (const std::exception&) {
+        }
+    }
+
+public:
+    explicit IncrementalExpression(const Calculator& calc, std::string_view text = {})
+        : calc(calc), source(text) {
+        rebuildAll();
+    }
+
+    const std::string& text() const {
+        return source;
+    }
+
+    // Replaces `length` characters at `offset` with `replacement`
+    void edit(size_t offset, size_t length, std::string_view replacement) {
+        if (offset > source.size() || length > source.size() - offset) {
+            throw std::out_of_range("Edit outside the expression");
+        }
+        size_t editEnd = offset + length;
+        source.replace(offset, length, replacement);
+        if (broken || !textFits()) {
+            rebuildAll();
+            return;
+        }
+        ptrdiff_t delta = static_cast<ptrdiff_t>(replacement.size()) - static_cast<ptrdiff_t>(length);
+
+        // Innermost group whose inside covers the edited range
+        Group* group = root.get();
+        size_t start = 0;
+        while (true) {
+            auto& children = group->children;
+            auto it = std::upper_bound(children.begin(), children.end(), offset - start,
+                                       [](size_t at, const auto& child) { return at < child->offset; });
+            if (it == children.begin()) break;
+            Group& child = **std::prev(it);
+            size_t childStart = start + child.offset;
+            if (editEnd > childStart + child.length) break;
+            group = &child;
+            start = childStart;
+        }
+
+        // Children clear of the edit survive; those it touches are reparsed
+        std::vector<std::unique_ptr<Group>> kept;
+        for (auto& child : group->children) {
+            size_t childStart = start + child->offset;
+            if (childStart + child->length + 1 <= offset) {
+                kept.push_back(std::move(child));
+            } else if (childStart - 1 >= editEnd) {
+                child->offset = static_cast<size_t>(static_cast<ptrdiff_t>(child->offset) + delta);
+                kept.push_back(std::move(child));
+            }
+        }
+        group->length = static_cast<size_t>(static_cast<ptrdiff_t>(group->length) + delta);
+
+        // Only running out of memory throws here, part way through the tree
+        try {
+            if (!rebuild(*group, start, std::move(kept))) {
+                rebuildAll();
+                return;
+            }
+        } catch (const std::exception&) {
+            broken = true;
+            return;
+        }
+
+        // The enclosing groups keep their code: only lengths, the offsets
+        // of later siblings and the values on the path change
+        for (Group* child = group; Group* parent = child->parent; child = parent) {
+            parent->length = static_cast<size_t>(static_cast<ptrdiff_t>(parent->length) + delta);
+            bool after = false;
+            for (auto& sibling : parent->children) {
+                if (after) sibling->offset = static_cast<size_t>(static_cast<ptrdiff_t>(sibling->offset) + delta);
+                if (sibling.get() == child) after = true;
+            }
+            evaluate(*parent);
+        }
+    }
+
+    // Value of the current text. Throws whatever Calculator::evaluate()
+    // throws for it when it does not evaluate, the Calculator's
+    // InputLimits included.
+    double value() const {
+        if (!broken && !root->failed &&
+            Calculator::memoryBound(source.size(), root->tokens, root->operands) <= calc.inputLimits().maxMemory) {
+            return root->value;
+        }
+        return calc.run(calc.compile(source));
+    }
+};
@@ -0,0 +1,464 @@
+#pragma once
+
+// Native code tier for hot programs. Enabled by default on x86-64 Linux;
+// build with -DCALC_ENABLE_JIT=0 to leave only the interpreters.
+#ifndef CALC_ENABLE_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define CALC_ENABLE_JIT 1
+#else
+#define CALC_ENABLE_JIT 0
+#endif
+#endif
+
+class JitProgram;
+
+#if CALC_ENABLE_JIT
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "program.h"
+
+// Minimal x86-64 encoder for the SSE2 and integer instructions the JIT
+// emits. Registers use their hardware numbers (rax = 0 ... r15 = 15,
+// xmm0 = 0 ... xmm15 = 15).
+class JitAssembler {
+private:
+    std::vector<std::uint8_t> code;
+
+    void rex(bool wide, int reg, int index, int base) {
+        std::uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3 & 1) << 2) |
+                              ((index >> 3 & 1) << 1) | (base >> 3 & 1);
+        if (prefix != 0x40) byte(prefix);
+    }
+
+    // [base + index * 8 + disp] with index < 0 meaning none, always encoded
+    // through a SIB byte and a 32-bit displacement
+    void memory(int reg, int base, int index, std::int32_t disp) {
+        byte(0x80 | (reg & 7) << 3 | 4);
+        byte((index < 0 ? 0 : 3 << 6) | ((index < 0 ? 4 : index) & 7) << 3 | (base & 7));
+        u32(static_cast<std::uint32_t>(disp));
+    }
+
+public:
+    static constexpr int RAX = 0, RBX = 3, RSP = 4, RSI = 6, RDI = 7;
+    static constexpr int R12 = 12, R13 = 13, R14 = 14, R15 = 15;
+
+    // Mandatory prefixes selecting the packed-double or scalar-double form
+    static constexpr std::uint8_t PACKED = 0x66;
+    static constexpr std::uint8_t SCALAR = 0xF2;
+
+    void byte(std::uint8_t value) {
+        code.push_back(value);
+    }
+
+    void u32(std::uint32_t value) {
+        for (int i = 0; i < 4; i++) byte(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+
+    void u64(std::uint64_t value) {
+        for (int i = 0; i < 8; i++) byte(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+
+    size_t size() const {
+        return code.size();
+    }
+
+    const std::vector<std::uint8_t>& bytes() const {
+        return code;
+    }
+
+    // SSE op between two xmm registers: dst = dst op src
+    void sse(std::uint8_t prefix, std::uint8_t op, int dst, int src) {
+        byte(prefix);
+        rex(false, dst, 0, src);
+        byte(0x0F);
+        byte(op);
+        byte(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    // SSE op between an xmm register and memory
+    void sseMemory(std::uint8_t prefix, std::uint8_t op, int reg, int base, int index, std::int32_t disp) {
+        byte(prefix);
+        rex(false, reg, index < 0 ? 0 : index, base);
+        byte(0x0F);
+        byte(op);
+        memory(reg, base, index, disp);
+    }
+
+    void push(int reg) {
+        rex(false, 0, 0, reg);
+        byte(0x50 | (reg & 7));
+    }
+
+    void pop(int reg) {
+        rex(false, 0, 0, reg);
+        byte(0x58 | (reg & 7));
+    }
+
+    void movRegReg(int dst, int src) {
+        rex(true, src, 0, dst);
+        byte(0x89);
+        byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    void movRegImm(int dst, std::uint64_t value) {
+        rex(true, 0, 0, dst);
+        byte(0xB8 | (dst & 7));
+        u64(value);
+    }
+
+    void movRegMemory(int dst, int base, std::int32_t disp) {
+        rex(true, dst, 0, base);
+        byte(0x8B);
+        memory(dst, base, -1, disp);
+    }
+
+    void lea(int dst, int base, std::int32_t disp) {
+        rex(true, dst, 0, base);
+        byte(0x8D);
+        memory(dst, base, -1, disp);
+    }
+
+    // add/sub reg, imm32
+    void addImm(int reg, std::int32_t value) {
+        rex(true, 0, 0, reg);
+        byte(0x81);
+        byte(0xC0 | (reg & 7));
+        u32(static_cast<std::uint32_t>(value));
+    }
+
+    void subImm(int reg, std::int32_t value) {
+        rex(true, 0, 0, reg);
+        byte(0x81);
+        byte(0xE8 | (reg & 7));
+        u32(static_cast<std::uint32_t>(value));
+    }
+
+    void cmpRegReg(int a, int b) {
+        rex(true, b, 0, a);
+        byte(0x39);
+        byte(0xC0 | (b & 7) << 3 | (a & 7));
+    }
+
+    void xorSelf32(int reg) {
+        rex(false, reg, 0, reg);
+        byte(0x31);
+        byte(0xC0 | (reg & 7) << 3 | (reg & 7));
+    }
+
+    // movmskpd eax, xmm
+    void moveMask(int xmm) {
+        byte(0x66);
+        rex(false, 0, 0, xmm);
+        byte(0x0F);
+        byte(0x50);
+        byte(0xC0 | (xmm & 7));
+    }
+
+    void testEax() {
+        byte(0x85);
+        byte(0xC0);
+    }
+
+    void callRax() {
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+    void ret() {
+        byte(0xC3);
+    }
+
+    // Jumps with a 32-bit displacement; returns the position to patch
+    size_t jump(std::uint8_t condition) {
+        if (condition == 0) {
+            byte(0xE9);
+        } else {
+            byte(0x0F);
+            byte(condition);
+        }
+        u32(0);
+        return code.size() - 4;
+    }
+
+    void patch(size_t position, size_t target) {
+        std::int32_t rel = static_cast<std::int32_t>(target - (position + 4));
+        std::memcpy(&code[position], &rel, 4);
+    }
+
+    static constexpr std::uint8_t JMP = 0, JNZ = 0x85, JA = 0x87, JAE = 0x83;
+};
+
+// A program compiled to native code. The generated function evaluates
+// `rows` rows of the bound columns into `out` and returns the number of
+// rows written; a smaller value is the row where a division by zero
+// stopped it. The value stack lives in xmm0..xmm13, two rows per register,
+// with a scalar loop for an odd final row.
+class JitProgram {
+public:
+    using Function = size_t (*)(const double* const* columns, double* out, size_t rows);
+
+private:
+    static constexpr int MAX_DEPTH = 14;
+    static constexpr int SCRATCH = 15;
+
+    // Temporaries live in the stack frame, which nothing probes. Capping
+    // them keeps the frame within one page, so `sub rsp` cannot step over
+    // the guard page; programs with more stay on the interpreter.
+    static constexpr size_t MAX_TEMPS = 224;
+
+    // Stack frame: xmm spills around calls, call arguments, temporaries
+    static constexpr std::int32_t SPILL_OFFSET = 0;
+    static constexpr std::int32_t CALL_OFFSET = 16 * MAX_DEPTH;
+    static constexpr std::int32_t TEMP_OFFSET = CALL_OFFSET + 32;
+
+    // SSE2 opcodes
+    static constexpr std::uint8_t MOVUPD_LOAD = 0x10, MOVUPD_STORE = 0x11, MOVAPD = 0x28;
+    static constexpr std::uint8_t ADD = 0x58, MUL = 0x59, SUB = 0x5C, DIV = 0x5E;
+    static constexpr std::uint8_t XORPD = 0x57, CMP = 0xC2;
+
+    void* memory = nullptr;
+    size_t mappedSize = 0;
+    std::vector<double> constants;      // Sign mask, then each literal twice, one per lane
+    Function entry = nullptr;
+
+    // Out-of-line operators: args holds the left operand lanes, then the
+    // right operand lanes, and receives the result in place of the left
+    static void powLanes(double* args, size_t lanes) {
+        for (size_t i = 0; i < lanes; i++) args[i] = std::pow(args[i], args[2 + i]);
+    }
+
+    static void modLanes(double* args, size_t lanes) {
+        for (size_t i = 0; i < lanes; i++) args[i] = std::fmod(args[i], args[2 + i]);
+    }
+
+    // Leaves the body when any lane of xmm(divisor) is zero
+    static void emitZeroCheck(JitAssembler& as, std::uint8_t lanePrefix, int divisor,
+                              std::vector<size_t>& divisionJumps) {
+        // scratch = (0 == b) per lane; any set bit is a zero divisor
+        as.sse(JitAssembler::PACKED, XORPD, SCRATCH, SCRATCH);
+        as.sse(lanePrefix, CMP, SCRATCH, divisor);
+        as.byte(0);     // Predicate: equal, ordered
+        as.moveMask(SCRATCH);
+        as.testEax();
+        divisionJumps.push_back(as.jump(JitAssembler::JNZ));
+    }
+
+    // xmm(a) = helper(xmm(a), xmm(a + 1)), preserving the registers below
+    static void emitCall(JitAssembler& as, void (*helper)(double*, size_t), int a, size_t lanes) {
+        // Everything below the operands is caller-saved
+        for (int i = 0; i < a; i++) {
+            as.sseMemory(JitAssembler::PACKED, MOVUPD_STORE, i, JitAssembler::RSP, -1, SPILL_OFFSET + 16 * i);
+        }
+        as.sseMemory(JitAssembler::PACKED, MOVUPD_STORE, a, JitAssembler::RSP, -1, CALL_OFFSET);
+        as.sseMemory(JitAssembler::PACKED, MOVUPD_STORE, a + 1, JitAssembler::RSP, -1, CALL_OFFSET + 16);
+        as.lea(JitAssembler::RDI, JitAssembler::RSP, CALL_OFFSET);
+        as.movRegImm(JitAssembler::RSI, lanes);
+        as.movRegImm(JitAssembler::RAX, reinterpret_cast<std::uint64_t>(helper));
+        as.callRax();
+        for (int i = 0; i < a; i++) {
+            as.sseMemory(JitAssembler::PACKED, MOVUPD_LOAD, i, JitAssembler::RSP, -1, SPILL_OFFSET + 16 * i);
+        }
+        as.sseMemory(JitAssembler::PACKED, MOVUPD_LOAD, a, JitAssembler::RSP, -1, CALL_OFFSET);
+    }
+
+    // Emits one evaluation of the program for one register's worth of rows
+    // (two in packed mode, one in scalar mode), finishing with the result
+    // stored to out[row]. Returns the division-by-zero jumps to patch.
+    void emitBody(JitAssembler& as, const Program& program, bool packed,
+                  std::vector<size_t>& divisionJumps) {
+        std::uint8_t lanePrefix = packed ? JitAssembler::PACKED : JitAssembler::SCALAR;
+        size_t lanes = packed ? 2 : 1;
+        int top = 0;
+        size_t literal = 0;
+
+        for (const Instruction& instr : program.code) {
+            switch (instr.op) {
+                case OpCode::Push:
+                    as.sseMemory(JitAssembler::PACKED, MOVUPD_LOAD, top++, JitAssembler::R15, -1,
+                                 static_cast<std::int32_t>(16 * ++literal));
+                    break;
+                case OpCode::Load:
+                    as.movRegMemory(JitAssembler::RAX, JitAssembler::R12, static_cast<std::int32_t>(8 * instr.index));
+                    as.sseMemory(lanePrefix, MOVUPD_LOAD, top++, JitAssembler::RAX, JitAssembler::RBX, 0);
+                    break;
+                case OpCode::StoreTemp:
+                    as.sseMemory(JitAssembler::PACKED, MOVUPD_STORE, top - 1, JitAssembler::RSP, -1,
+                                 TEMP_OFFSET + static_cast<std::int32_t>(16 * instr.index));
+                    break;
+                case OpCode::LoadTemp:
+                    as.sseMemory(JitAssembler::PACKED, MOVUPD_LOAD, top++, JitAssembler::RSP, -1,
+                                 TEMP_OFFSET + static_cast<std::int32_t>(16 * instr.index));
+                    break;
+                case OpCode::Add:
+                    top--;
+                    as.sse(lanePrefix, ADD, top - 1, top);
+                    break;
+                case OpCode::Sub:
+                    top--;
+                    as.sse(lanePrefix, SUB, top - 1, top);
+                    break;
+                case OpCode::Mul:
+                    top--;
+                    as.sse(lanePrefix, MUL, top - 1, top);
+                    break;
+                case OpCode::Div:
+                    top--;
+                    emitZeroCheck(as, lanePrefix, top, divisionJumps);
+                    as.sse(lanePrefix, DIV, top - 1, top);
+                    break;
+                case OpCode::Mod:
+                    top--;
+                    emitZeroCheck(as, lanePrefix, top, divisionJumps);
+                    emitCall(as, modLanes, top - 1, lanes);
+                    break;
+                case OpCode::Pow:
+                    top--;
+                    emitCall(as, powLanes, top - 1, lanes);
+                    break;
+                case OpCode::Neg:
+                    // Flip the sign bit, so -0 and NaN behave as in C++
+                    as.sseMemory(JitAssembler::PACKED, MOVUPD_LOAD, SCRATCH, JitAssembler::R15, -1, 0);
+                    as.sse(JitAssembler::PACKED, XORPD, top - 1, SCRATCH);
+                    break;
+                default:
+                    // Superinstructions exist only in fused interpreter code
+                    break;
+            }
+        }
+        as.sseMemory(lanePrefix, MOVUPD_STORE, 0, JitAssembler::R13, JitAssembler::RBX, 0);
+    }
+
+    bool generate(const Program& program) {
+        if (program.maxDepth > MAX_DEPTH || program.tempCount > MAX_TEMPS || program.code.empty()) return false;
+        constants = {-0.0, -0.0};
+        for (const Instruction& instr : program.code) {
+            if (instr.op == OpCode::Push) {
+                constants.push_back(instr.value);
+                constants.push_back(instr.value);
+            }
+        }
+
+        auto frame = static_cast<std::int32_t>(TEMP_OFFSET + 16 * program.tempCount);
+        JitAssembler as;
+        std::vector<size_t> divisionJumps;
+
+        // Callee-saved state: r12 columns, r13 out, r14 rows, r15 literals,
+        // rbx current row. Five pushes keep rsp 16-byte aligned.
+        for (int reg : {JitAssembler::RBX, JitAssembler::R12, JitAssembler::R13, JitAssembler::R14, JitAssembler::R15}) {
+            as.push(reg);
+        }
+        as.subImm(JitAssembler::RSP, frame);
+        as.movRegReg(JitAssembler::R12, JitAssembler::RDI);
+        as.movRegReg(JitAssembler::R13, JitAssembler::RSI);
+        as.movRegReg(JitAssembler::R14, 2);     // rdx
+        as.movRegImm(JitAssembler::R15, reinterpret_cast<std::uint64_t>(constants.data()));
+        as.xorSelf32(JitAssembler::RBX);
+
+        // Two rows per iteration while rbx + 2 <= rows
+        size_t packedLoop = as.size();
+        as.lea(JitAssembler::RAX, JitAssembler::RBX, 2);
+        as.cmpRegReg(JitAssembler::RAX, JitAssembler::R14);
+        size_t toScalar = as.jump(JitAssembler::JA);
+        emitBody(as, program, true, divisionJumps);
+        as.addImm(JitAssembler::RBX, 2);
+        as.patch(as.jump(JitAssembler::JMP), packedLoop);
+
+        as.patch(toScalar, as.size());
+        size_t scalarLoop = as.size();
+        as.cmpRegReg(JitAssembler::RBX, JitAssembler::R14);
+        size_t toDone = as.jump(JitAssembler::JAE);
+        emitBody(as, program, false, divisionJumps);
+        as.addImm(JitAssembler::RBX, 1);
+        as.patch(as.jump(JitAssembler::JMP), scalarLoop);
+
+        // Both the normal exit and a division by zero return rbx
+        size_t done = as.size();
+        as.patch(toDone, done);
+        for (size_t position : divisionJumps) as.patch(position, done);
+        as.movRegReg(JitAssembler::RAX, JitAssembler::RBX);
+        as.addImm(JitAssembler::RSP, frame);
+        for (int reg : {JitAssembler::R15, JitAssembler::R14, JitAssembler::R13, JitAssembler::R12, JitAssembler::RBX}) {
+            as.pop(reg);
+        }
+        as.ret();
+
+        mappedSize = as.size();
+        memory = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            return false;
+        }
+        std::memcpy(memory, as.bytes().data(), mappedSize);
+        if (::mprotect(memory, mappedSize, PROT_READ | PROT_EXEC) != 0) return false;
+        entry = reinterpret_cast<Function>(memory);
+        return true;
+    }
+
+public:
+    JitProgram() = default;
+    JitProgram(const JitProgram&) = delete;
+    JitProgram& operator=(const JitProgram&) = delete;
+
+    ~JitProgram() {
+        if (memory) ::munmap(memory, mappedSize);
+    }
+
+    // Returns null for programs the code generator does not handle (value
+    // stacks deeper than the register file); those stay interpreted
+    static std::unique_ptr<JitProgram> compile(const Program& program) {
+        auto jit = std::make_unique<JitProgram>();
+        if (!jit->generate(program)) return nullptr;
+        return jit;
+    }
+
+    Function function() const {
+        return entry;
+    }
+
+    // Evaluates rows [begin, end) of the columns into out[0, end - begin)
+    void run(std::span<const std::span<const double>> columns, size_t begin, size_t end, double* out) const {
+        if (runUntilError(columns, begin, end, out) != end - begin) {
+            throw std::runtime_error("Division by zero");
+        }
+    }
+
+    // Non-throwing run(): returns the rows written. Fewer than asked means
+    // the next row divides by zero.
+    size_t runUntilError(std::span<const std::span<const double>> columns, size_t begin, size_t end,
+                         double* out) const {
+        static thread_local std::vector<const double*> bound;
+        bound.resize(columns.size());
+        for (size_t i = 0; i < columns.size(); i++) bound[i] = columns[i].data() + begin;
+        return entry(bound.data(), out, end - begin);
+    }
+};
+
+// Hotness counter of one cached program and its native code once compiled.
+// The caller that reaches the threshold compiles and publishes the code;
+// everyone else keeps interpreting until then.
+struct JitTier {
+    std::atomic<std::uint64_t> runs{0};
+    std::atomic<const JitProgram*> ready{nullptr};
+    std::unique_ptr<JitProgram> code;       // Written once, by the compiling caller
+
+    const JitProgram* hot(const Program& program, std::uint64_t threshold) {
+        if (const JitProgram* jit = ready.load(std::memory_order_acquire)) return jit;
+        if (runs.fetch_add(1, std::memory_order_relaxed) + 1 != threshold) return nullptr;
+        code = JitProgram::compile(program);
+        ready.store(code.get(), std::memory_order_release);
+        return code.get();
+    }
+};
+
+#endif
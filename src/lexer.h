@@ -0,0 +1,258 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "eval_error.h"
+#include "operations.h"
+
+enum class TokenKind : std::uint8_t {
+    Number,
+    Variable,
+    Operator,
+    OpenBracket,
+    CloseBracket
+};
+
+struct Token {
+    TokenKind kind;
+    char symbol;        // Operator or bracket character, 0 for numbers
+    double value;       // Parsed value of a Number token
+    size_t offset;      // Position of the token in the source expression
+    size_t length;
+};
+
+// Table-driven DFA tokenizer. The character classes mirror the token
+// patterns the calculator used to match with std::regex:
+//   number       \d+(\.\d+)?
+//   variable     [A-Za-z_][A-Za-z0-9_]*
+//   operator     any character in the Operators table; prefix operators
+//                such as '-' may also start an operand
+//   parenthesis  [(){}]
+//   whitespace   \s+   (only before or after the expression)
+// A single left-to-right pass validates the grammar, checks bracket
+// balance and produces the token vector consumed by the evaluator.
+class Lexer {
+private:
+    enum CharClass : std::uint8_t {
+        C_SPACE,
+        C_DIGIT,
+        C_DOT,
+        C_ALPHA,
+        C_OPERATOR,
+        C_SIGN,         // Operator that can also be used as a prefix
+        C_OPEN,
+        C_CLOSE,
+        C_OTHER,
+        CHAR_CLASS_COUNT
+    };
+
+    enum State : std::uint8_t {
+        S_START,        // Leading whitespace, expecting an operand
+        S_OPERAND,      // After an operator or an opening bracket
+        S_INTEGER,      // Inside the integer part of a number
+        S_DOT,          // After the decimal point, a digit is required
+        S_FRACTION,     // Inside the fractional part of a number
+        S_IDENTIFIER,   // Inside a variable name
+        S_CLOSED,       // After a closing bracket
+        S_TRAILING,     // Trailing whitespace, nothing else may follow
+        S_ERROR,
+        STATE_COUNT
+    };
+
+    using CharTable = std::array<CharClass, 256>;
+    using TransitionTable = std::array<std::array<State, CHAR_CLASS_COUNT>, STATE_COUNT>;
+
+    static constexpr CharTable makeCharClasses() {
+        CharTable table{};
+        for (auto& entry : table) entry = C_OTHER;
+        for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) table[c] = C_SPACE;
+        for (unsigned char c = '0'; c <= '9'; c++) table[c] = C_DIGIT;
+        table['.'] = C_DOT;
+        for (unsigned char c = 'a'; c <= 'z'; c++) table[c] = C_ALPHA;
+        for (unsigned char c = 'A'; c <= 'Z'; c++) table[c] = C_ALPHA;
+        table['_'] = C_ALPHA;
+        for (int c = 0; c < 256; c++) {
+            if (Operators::isPrefix(static_cast<char>(c))) {
+                table[c] = C_SIGN;
+            } else if (Operators::isOperator(static_cast<char>(c))) {
+                table[c] = C_OPERATOR;
+            }
+        }
+        table['('] = C_OPEN;
+        table['{'] = C_OPEN;
+        table[')'] = C_CLOSE;
+        table['}'] = C_CLOSE;
+        return table;
+    }
+
+    static constexpr TransitionTable makeTransitions() {
+        TransitionTable table{};
+        for (auto& row : table) {
+            for (auto& entry : row) entry = S_ERROR;
+        }
+
+        // Wherever an operand is expected: a number, a variable, an opening
+        // bracket or a prefix operator
+        for (State s : {S_START, S_OPERAND}) {
+            table[s][C_DIGIT] = S_INTEGER;
+            table[s][C_ALPHA] = S_IDENTIFIER;
+            table[s][C_OPEN] = S_OPERAND;
+            table[s][C_SIGN] = S_OPERAND;
+        }
+        table[S_START][C_SPACE] = S_START;
+
+        table[S_INTEGER][C_DIGIT] = S_INTEGER;
+        table[S_INTEGER][C_DOT] = S_DOT;
+        table[S_DOT][C_DIGIT] = S_FRACTION;
+        table[S_FRACTION][C_DIGIT] = S_FRACTION;
+        table[S_IDENTIFIER][C_ALPHA] = S_IDENTIFIER;
+        table[S_IDENTIFIER][C_DIGIT] = S_IDENTIFIER;
+
+        // After a complete operand: an operator, a closing bracket or the end
+        for (State s : {S_INTEGER, S_FRACTION, S_IDENTIFIER, S_CLOSED}) {
+            table[s][C_OPERATOR] = S_OPERAND;
+            table[s][C_SIGN] = S_OPERAND;
+            table[s][C_CLOSE] = S_CLOSED;
+            table[s][C_SPACE] = S_TRAILING;
+        }
+        table[S_TRAILING][C_SPACE] = S_TRAILING;
+        return table;
+    }
+
+    static const CharTable CHAR_CLASSES;
+    static const TransitionTable TRANSITIONS;
+
+    static constexpr bool isNumberState(State s) {
+        return s == S_INTEGER || s == S_DOT || s == S_FRACTION;
+    }
+
+    static constexpr bool isOperandState(State s) {
+        return isNumberState(s) || s == S_IDENTIFIER;
+    }
+
+    static constexpr bool isAcceptingState(State s) {
+        return s == S_INTEGER || s == S_FRACTION || s == S_IDENTIFIER ||
+               s == S_CLOSED || s == S_TRAILING;
+    }
+
+    // Compile-time number parsing: digits accumulate into an integer that is
+    // scaled once by a power of ten. This is exact, and equal to from_chars,
+    // for literals of up to 15 significant digits and 22 decimals.
+    static constexpr double parseNumber(std::string_view text) {
+        double digits = 0;
+        double scale = 1;
+        bool fraction = false;
+        for (char c : text) {
+            if (c == '.') {
+                fraction = true;
+                continue;
+            }
+            digits = digits * 10 + (c - '0');
+            if (fraction) scale *= 10;
+        }
+        return digits / scale;
+    }
+
+    static constexpr Token makeOperand(std::string_view expression, State state, size_t start, size_t end) {
+        if (state == S_IDENTIFIER) {
+            return {TokenKind::Variable, 0, 0, start, end - start};
+        }
+        // The DFA has already checked the digits, so parsing cannot fail
+        double value = 0;
+        if (std::is_constant_evaluated()) {
+            value = parseNumber(expression.substr(start, end - start));
+        } else {
+            std::from_chars(expression.data() + start, expression.data() + end, value);
+        }
+        return {TokenKind::Number, 0, value, start, end - start};
+    }
+
+    static constexpr bool isMatchingPair(char opening, char closing) {
+        return (opening == '(' && closing == ')') ||
+               (opening == '{' && closing == '}');
+    }
+
+public:
+    // Non-throwing pass: appends the tokens of `expression` to `tokens`, or
+    // returns the first error and the byte it was found at. Brackets open
+    // more than `maxDepth` deep fail as soon as they are seen, and more than
+    // `maxTokens` tokens fail as MemoryBudgetExceeded once a byte adds one.
+    static constexpr std::optional<EvalError> scan(std::string_view expression, std::vector<Token>& tokens,
+                                                   size_t maxDepth = static_cast<size_t>(-1),
+                                                   size_t maxTokens = static_cast<size_t>(-1)) {
+        std::vector<size_t> brackets;      // Offsets of the open brackets
+        State state = S_START;
+        size_t operandStart = 0;
+
+        for (size_t i = 0; i < expression.length(); i++) {
+            if (tokens.size() > maxTokens) {
+                return EvalError{EvalErrorCode::MemoryBudgetExceeded, i};
+            }
+            char c = expression[i];
+            CharClass cls = CHAR_CLASSES[static_cast<unsigned char>(c)];
+            State next = TRANSITIONS[state][cls];
+            if (next == S_ERROR) {
+                return EvalError{EvalErrorCode::InvalidFormat, i};
+            }
+
+            if (!isOperandState(state) && isOperandState(next)) {
+                operandStart = i;
+            } else if (isOperandState(state) && !isOperandState(next)) {
+                tokens.push_back(makeOperand(expression, state, operandStart, i));
+            }
+
+            if (cls == C_OPERATOR || cls == C_SIGN) {
+                tokens.push_back({TokenKind::Operator, c, 0, i, 1});
+            } else if (cls == C_OPEN) {
+                if (brackets.size() == maxDepth) {
+                    return EvalError{EvalErrorCode::NestedTooDeeply, i};
+                }
+                brackets.push_back(i);
+                tokens.push_back({TokenKind::OpenBracket, c, 0, i, 1});
+            } else if (cls == C_CLOSE) {
+                if (brackets.empty() || !isMatchingPair(expression[brackets.back()], c)) {
+                    return EvalError{EvalErrorCode::MismatchedBrackets, i};
+                }
+                brackets.pop_back();
+                tokens.push_back({TokenKind::CloseBracket, c, 0, i, 1});
+            }
+            state = next;
+        }
+
+        if (!isAcceptingState(state)) {
+            return EvalError{EvalErrorCode::InvalidFormat, expression.length()};
+        }
+        if (isOperandState(state)) {
+            tokens.push_back(makeOperand(expression, state, operandStart, expression.length()));
+        }
+        if (tokens.size() > maxTokens) {
+            return EvalError{EvalErrorCode::MemoryBudgetExceeded, expression.length()};
+        }
+        if (!brackets.empty()) {
+            return EvalError{EvalErrorCode::UnclosedBrackets, brackets.back()};
+        }
+        return std::nullopt;
+    }
+
+    // Also usable in constant expressions, where a syntax error stops
+    // compilation at the throw
+    static constexpr std::vector<Token> tokenize(std::string_view expression,
+                                                 size_t maxDepth = static_cast<size_t>(-1)) {
+        std::vector<Token> tokens;
+        if (std::optional<EvalError> error = scan(expression, tokens, maxDepth)) {
+            throw std::invalid_argument(error->message());
+        }
+        return tokens;
+    }
+};
+
+inline constexpr Lexer::CharTable Lexer::CHAR_CLASSES = Lexer::makeCharClasses();
+inline constexpr Lexer::TransitionTable Lexer::TRANSITIONS = Lexer::makeTransitions();
@@ -1,226 +1,171 @@
+#include <charconv>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <string>
-#include <regex>
-#include <stack>
-#include <cmath>
-#include <stdexcept>
+#include <string_view>
+#include <system_error>
 #include <vector>
-#include <iomanip>
-#include <sstream>
-
-class Calculator {
-private:
-    const std::regex NUMBER_PATTERN{"\\d+(\\.\\d+)?"};
-    const std::regex OPERATOR_PATTERN{"[+\\-*/^]"};
-    const std::regex PARENTHESIS_PATTERN{"[(){}]"};
-    const std::regex WHITESPACE_PATTERN{"\\s+"};
-    const std::regex VALID_EXPRESSION{
-        "^[\\s]*([(){}]|\\d+(\\.\\d+)?|[+\\-*/^])+[\\s]*$"
-    };
-
-    std::vector<std::string> steps;
-
-    std::string replaceInExpression(const std::string& expr, size_t start, size_t length, const std::string& replacement) {
-        std::string result = expr;
-        result.replace(start, length, replacement);
-        return result;
-    }
 
-    void addStep(const std::string& step) {
-        // Only add the step if it's different from the last one
-        if (steps.empty() || steps.back() != step) {
-            steps.push_back(step);
+#include "batch_runner.h"
+#include "calculator.h"
+#include "format.h"
+#include "program_file.h"
+#include "server.h"
+
+static int usage() {
+    std::cerr << "Usage: program [--batch [input|-] [--out output] [--stats]]\n"
+                 "       program --compile [input|-] --out output\n"
+                 "       program --serve <port|host:port|unix:path> [--threads n]" << std::endl;
+    return 2;
+}
+
+// program --batch [input|-] [--out output] [--stats]: one expression per
+// line from a file or stdin, one result per line to a file or stdout.
+// --stats writes the collected metrics to stderr in Prometheus format,
+// followed by the fusion report as comments.
+static int runBatch(const Calculator& calc, const std::vector<std::string_view>& args) {
+    std::string input = "-";
+    std::string output = "-";
+    bool stats = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "--out" && i + 1 < args.size()) {
+            output = args[++i];
+        } else if (args[i] == "--stats") {
+            stats = true;
+        } else if (args[i].substr(0, 2) != "--" || args[i] == "-") {
+            input = args[i];
+        } else {
+            return usage();
         }
     }
 
-    bool isOperator(char c) {
-        return c == '+' || c == '-' || c == '*' || c == '/' || c == '^';
+    std::FILE* out = output == "-" ? stdout : std::fopen(output.c_str(), "wb");
+    if (!out) {
+        std::cerr << "Error: cannot open " << output << std::endl;
+        return 1;
     }
 
-    int getPrecedence(char op) {
-        if (op == '^') return 3;
-        if (op == '*' || op == '/') return 2;
-        if (op == '+' || op == '-') return 1;
-        return 0;
+    BatchRunner runner(calc, ThreadPool::shared(), out);
+    bool ok = true;
+    if (input == "-") {
+        runner.runStream(stdin);
+    } else {
+        ok = runner.runFile(input.c_str());
     }
-
-    std::string formatNumber(double num) {
-        std::ostringstream ss;
-        ss << std::fixed << std::setprecision(2);
-        ss << num;
-        std::string str = ss.str();
-        // Remove trailing zeros and decimal point if not needed
-        if (str.find('.') != std::string::npos) {
-            str = str.substr(0, str.find_last_not_of('0') + 1);
-            if (str.back() == '.') {
-                str = str.substr(0, str.size() - 1);
-            }
-        }
-        return str;
+    if (out != stdout) std::fclose(out);
+    if (stats) {
+        StatsSnapshot snapshot = calc.stats();
+        std::cerr << snapshot.prometheus() << snapshot.fusionReport();
     }
-
-    std::string evaluateSubExpression(const std::string& expr, size_t start, size_t end) {
-        std::string subExpr = expr.substr(start, end - start + 1);
-        std::stack<double> values;
-        std::stack<char> ops;
-        std::string currentNum;
-
-        for (size_t i = 0; i < subExpr.length(); i++) {
-            char c = subExpr[i];
-            if (std::isdigit(c) || c == '.') {
-                currentNum += c;
-            } else {
-                if (!currentNum.empty()) {
-                    values.push(std::stod(currentNum));
-                    currentNum.clear();
-                }
-                if (isOperator(c)) {
-                    while (!ops.empty() && getPrecedence(ops.top()) >= getPrecedence(c)) {
-                        double b = values.top(); values.pop();
-                        double a = values.top(); values.pop();
-                        char op = ops.top(); ops.pop();
-                        values.push(applyOperation(a, b, op));
-                        
-                        // Add intermediate step
-                        std::string step = formatNumber(a) + " " + op + " " + formatNumber(b) + " = " + formatNumber(values.top());
-                        addStep(step);
-                    }
-                    ops.push(c);
-                }
-            }
-        }
-
-        if (!currentNum.empty()) {
-            values.push(std::stod(currentNum));
-        }
-
-        while (!ops.empty()) {
-            double b = values.top(); values.pop();
-            double a = values.top(); values.pop();
-            char op = ops.top(); ops.pop();
-            values.push(applyOperation(a, b, op));
-            
-            // Add intermediate step
-            std::string step = formatNumber(a) + " " + op + " " + formatNumber(b) + " = " + formatNumber(values.top());
-            addStep(step);
-        }
-
-        return formatNumber(values.top());
+    if (!ok) {
+        std::cerr << "Error: cannot open " << input << std::endl;
+        return 1;
     }
-
-    double applyOperation(double a, double b, char op) {
-        switch (op) {
-            case '+': return a + b;
-            case '-': return a - b;
-            case '*': return a * b;
-            case '/': 
-                if (b == 0) throw std::runtime_error("Division by zero");
-                return a / b;
-            case '^': return std::pow(a, b);
-            default: throw std::runtime_error("Invalid operator");
+    return 0;
+}
+
+// program --compile [input|-] --out output: compiles one expression per
+// line into a program file. Any invalid line is reported by number and
+// nothing is written.
+static int runCompile(const Calculator& calc, const std::vector<std::string_view>& args) {
+    std::string input = "-";
+    std::string output;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "--out" && i + 1 < args.size()) {
+            output = args[++i];
+        } else if (args[i].substr(0, 2) != "--" || args[i] == "-") {
+            input = args[i];
+        } else {
+            return usage();
         }
     }
+    if (output.empty()) return usage();
 
-    bool isMatchingPair(char opening, char closing) {
-        return (opening == '(' && closing == ')') ||
-               (opening == '{' && closing == '}');
-    }
-
-public:
-    void printRegexMatches(const std::string& expression) {
-        std::cout << "\nRegex Pattern Matches:" << std::endl;
-        
-        std::cout << "Numbers found:" << std::endl;
-        auto numbers_begin = std::sregex_iterator(expression.begin(), expression.end(), NUMBER_PATTERN);
-        auto numbers_end = std::sregex_iterator();
-        for (std::sregex_iterator i = numbers_begin; i != numbers_end; ++i) {
-            std::cout << "  - " << i->str() << std::endl;
-        }
-
-        std::cout << "Operators found:" << std::endl;
-        auto operators_begin = std::sregex_iterator(expression.begin(), expression.end(), OPERATOR_PATTERN);
-        auto operators_end = std::sregex_iterator();
-        for (std::sregex_iterator i = operators_begin; i != operators_end; ++i) {
-            std::cout << "  - " << i->str() << std::endl;
-        }
-
-        std::cout << "Parentheses/Braces found:" << std::endl;
-        auto parens_begin = std::sregex_iterator(expression.begin(), expression.end(), PARENTHESIS_PATTERN);
-        auto parens_end = std::sregex_iterator();
-        for (std::sregex_iterator i = parens_begin; i != parens_end; ++i) {
-            std::cout << " " << i->str() << " ";
+    std::ifstream file;
+    if (input != "-") {
+        file.open(input);
+        if (!file) {
+            std::cerr << "Error: cannot open " << input << std::endl;
+            return 1;
         }
-        std::cout << std::endl;
     }
-
-    void validateExpression(const std::string& expression) {
-        if (!std::regex_match(expression, VALID_EXPRESSION)) {
-            throw std::invalid_argument("Invalid expression format");
-        }
-
-        std::stack<char> brackets;
-        for (char c : expression) {
-            if (c == '(' || c == '{') {
-                brackets.push(c);
-            } else if (c == ')' || c == '}') {
-                if (brackets.empty() || !isMatchingPair(brackets.top(), c)) {
-                    throw std::invalid_argument("Mismatched brackets");
-                }
-                brackets.pop();
-            }
-        }
-        if (!brackets.empty()) {
-            throw std::invalid_argument("Unclosed brackets");
+    std::istream& in = input == "-" ? std::cin : file;
+
+    ProgramWriter writer;
+    std::string line;
+    size_t number = 0;
+    bool ok = true;
+    while (std::getline(in, line)) {
+        number++;
+        if (ProgramCache::normalize(line).empty()) continue;
+        try {
+            writer.add(line, calc.optimize(calc.compile(line)));
+        } catch (const std::exception& e) {
+            std::cerr << input << ':' << number << ": " << e.what() << '\n';
+            ok = false;
         }
     }
+    if (!ok) return 1;
 
-    double evaluate(const std::string& expression) {
-        steps.clear();
-        std::string currentExpr = expression;
-        addStep(currentExpr);
-        validateExpression(expression);
-        printRegexMatches(expression);
-
-        // Keep evaluating until we have a single number
-        while (true) {
-            // Find innermost parentheses
-            size_t openPos = currentExpr.find_last_of("({");
-            if (openPos == std::string::npos) {
-                // No more parentheses, evaluate the remaining expression
-                if (std::regex_search(currentExpr, OPERATOR_PATTERN)) {
-                    std::string result = evaluateSubExpression(currentExpr, 0, currentExpr.length() - 1);
-                    addStep(result);
-                }
-                break;
-            }
-
-            // Find matching closing parenthesis
-            size_t closePos = currentExpr.find_first_of(")}", openPos);
-            if (closePos == std::string::npos) {
-                throw std::invalid_argument("Mismatched parentheses");
-            }
-
-            // Evaluate the subexpression
-            std::string subExprResult = evaluateSubExpression(currentExpr, openPos + 1, closePos - 1);
-            
-            // Replace the parentheses and their contents with the result
-            currentExpr = replaceInExpression(currentExpr, openPos, closePos - openPos + 1, subExprResult);
-            addStep(currentExpr);
+    std::string bytes = writer.finish();
+    std::ofstream out(output, std::ios::binary);
+    if (!out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()))) {
+        std::cerr << "Error: cannot write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static Server* activeServer = nullptr;
+
+static void stopServer(int) {
+    if (activeServer) activeServer->stop();
+}
+
+// program --serve <endpoint> [--threads n]: answers length-prefixed
+// expression frames until interrupted
+static int runServer(const Calculator& calc, const std::vector<std::string_view>& args) {
+    if (args.size() < 2) return usage();
+    size_t threads = std::thread::hardware_concurrency();
+    for (size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "--threads" && i + 1 < args.size()) {
+            // A whole positive number, nothing else
+            std::string_view count = args[++i];
+            auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), threads);
+            if (error != std::errc() || end != count.data() + count.size() || threads == 0) return usage();
+        } else {
+            return usage();
         }
-
-        return std::stod(steps.back());
     }
 
-    void printSteps() {
-        std::cout << "\nEvaluation Steps:" << std::endl;
-        for (size_t i = 0; i < steps.size(); i++) {
-            std::cout << i + 1 << ". " << steps[i] << std::endl;
-        }
+    try {
+        Server server(calc, Endpoint::parse(args[1]), threads);
+        activeServer = &server;
+        std::signal(SIGINT, stopServer);
+        std::signal(SIGTERM, stopServer);
+        server.run();
+        activeServer = nullptr;
+    } catch (const std::exception& e) {
+        activeServer = nullptr;
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const Calculator calc;
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+    if (!args.empty()) {
+        if (args[0] == "--batch") return runBatch(calc, args);
+        if (args[0] == "--compile") return runCompile(calc, args);
+        if (args[0] == "--serve") return runServer(calc, args);
+        return usage();
     }
-};
 
-int main() {
-    Calculator calc;
+    EvalContext context;
 
     while (true) {
         std::cout << "\nEnter an expression (or 'q' to quit): ";
@@ -233,13 +178,14 @@ int main() {
 
         try {
             std::cout << "\nExpression: " << expression << std::endl;
-            double result = calc.evaluate(expression);
-            calc.printSteps();
-            std::cout << "\nResult: " << result << std::endl;
+            calc.inspect(expression);
+            double result = calc.evaluate(expression, context);
+            context.printSteps();
+            std::cout << "\nResult: " << formatNumber(result) << std::endl;
         } catch (const std::exception& e) {
             std::cout << "Error: " << e.what() << std::endl;
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "format.h"
+#include "operations.h"
+#include "program.h"
+
+#ifndef CALC_ENABLE_GMP
+#if __has_include(<gmpxx.h>)
+#define CALC_ENABLE_GMP 1
+#else
+#define CALC_ENABLE_GMP 0
+#endif
+#endif
+
+#if CALC_ENABLE_GMP
+#include <gmpxx.h>
+#endif
+
+// A numeric policy tells the typed evaluator how to work with one number
+// type: parse a literal from its source text, apply an operator and format
+// a result. Operator syntax (precedence and associativity) lives in the
+// Operators table and is the same for every type. double keeps its own
+// non-template applyOperation(), so the default path never goes through here.
+template <typename T>
+struct NumericPolicy;
+
+template <>
+struct NumericPolicy<double> {
+    static double parse(std::string_view text) {
+        double value = 0;
+        std::from_chars(text.data(), text.data() + text.size(), value);
+        return value;
+    }
+
+    static double apply(double a, double b, OpCode op) {
+        return applyOperation(a, b, op);
+    }
+
+    static void format(std::string& out, double value) {
+        appendNumber(out, value);
+    }
+};
+
+// Single precision, with the same operator semantics as double
+template <>
+struct NumericPolicy<float> {
+    static float parse(std::string_view text) {
+        float value = 0;
+        std::from_chars(text.data(), text.data() + text.size(), value);
+        return value;
+    }
+
+    static float apply(float a, float b, OpCode op) {
+        switch (op) {
+            case OpCode::Add: return a + b;
+            case OpCode::Sub: return a - b;
+            case OpCode::Mul: return a * b;
+            case OpCode::Pow: return std::pow(a, b);
+            case OpCode::Div:
+                if (b == 0) throw std::runtime_error("Division by zero");
+                return a / b;
+            case OpCode::Mod:
+                if (b == 0) throw std::runtime_error("Division by zero");
+                return std::fmod(a, b);
+            default:
+                throw std::runtime_error("Invalid operator");
+        }
+    }
+
+    static void format(std::string& out, float value) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+    }
+};
+
+// Signed 64-bit fixed-point decimal with `Places` digits after the point.
+// Sums are exact, products and quotients round half away from zero, and
+// any result outside the 64-bit range throws instead of wrapping.
+template <unsigned Places>
+class FixedDecimal {
+private:
+    static_assert(Places <= 18, "A 64-bit decimal holds at most 18 fractional digits");
+
+    std::int64_t raw = 0;
+
+    static constexpr std::int64_t scaleOf() {
+        std::int64_t scale = 1;
+        for (unsigned i = 0; i < Places; i++) scale *= 10;
+        return scale;
+    }
+
+    [[noreturn]] static void overflow() {
+        throw std::overflow_error("Fixed-point overflow");
+    }
+
+    static std::int64_t narrow(__int128 value) {
+        if (value > std::numeric_limits<std::int64_t>::max() || value < std::numeric_limits<std::int64_t>::min()) {
+            overflow();
+        }
+        return static_cast<std::int64_t>(value);
+    }
+
+    // n / d rounded half away from zero
+    static __int128 divideRounded(__int128 n, __int128 d) {
+        __int128 quotient = n / d;
+        __int128 remainder = n % d;
+        if (remainder < 0) remainder = -remainder;
+        if (2 * remainder >= (d < 0 ? -d : d)) quotient += (n < 0) == (d < 0) ? 1 : -1;
+        return quotient;
+    }
+
+public:
+    static constexpr std::int64_t SCALE = scaleOf();
+
+    constexpr FixedDecimal() = default;
+
+    static constexpr FixedDecimal fromRaw(std::int64_t raw) {
+        FixedDecimal value;
+        value.raw = raw;
+        return value;
+    }
+
+    static FixedDecimal fromInteger(std::int64_t integer) {
+        return fromRaw(narrow(static_cast<__int128>(integer) * SCALE));
+    }
+
+    constexpr std::int64_t rawValue() const {
+        return raw;
+    }
+
+    bool isInteger() const {
+        return raw % SCALE == 0;
+    }
+
+    friend FixedDecimal operator+(FixedDecimal a, FixedDecimal b) {
+        std::int64_t sum;
+        if (__builtin_add_overflow(a.raw, b.raw, &sum)) overflow();
+        return fromRaw(sum);
+    }
+
+    friend FixedDecimal operator-(FixedDecimal a, FixedDecimal b) {
+        std::int64_t difference;
+        if (__builtin_sub_overflow(a.raw, b.raw, &difference)) overflow();
+        return fromRaw(difference);
+    }
+
+    friend FixedDecimal operator-(FixedDecimal a) {
+        return FixedDecimal() - a;
+    }
+
+    friend FixedDecimal operator*(FixedDecimal a, FixedDecimal b) {
+        return fromRaw(narrow(divideRounded(static_cast<__int128>(a.raw) * b.raw, SCALE)));
+    }
+
+    friend FixedDecimal operator/(FixedDecimal a, FixedDecimal b) {
+        if (b.raw == 0) throw std::runtime_error("Division by zero");
+        return fromRaw(narrow(divideRounded(static_cast<__int128>(a.raw) * SCALE, b.raw)));
+    }
+
+    // Remainder with the sign of the dividend, as in C. Anything modulo
+    // the smallest step is 0; INT64_MIN % -1 would trap.
+    friend FixedDecimal operator%(FixedDecimal a, FixedDecimal b) {
+        if (b.raw == 0) throw std::runtime_error("Division by zero");
+        if (b.raw == -1) return fromRaw(0);
+        return fromRaw(a.raw % b.raw);
+    }
+
+    friend bool operator==(FixedDecimal a, FixedDecimal b) = default;
+};
+
+template <unsigned Places>
+struct NumericPolicy<FixedDecimal<Places>> {
+    using Fixed = FixedDecimal<Places>;
+
+    // Digits past `Places` round half away from zero
+    static Fixed parse(std::string_view text) {
+        __int128 raw = 0;
+        size_t pos = 0;
+        for (; pos < text.size() && text[pos] != '.'; pos++) {
+            raw = raw * 10 + (text[pos] - '0');
+            if (raw > std::numeric_limits<std::int64_t>::max()) throw std::overflow_error("Fixed-point overflow");
+        }
+        unsigned places = 0;
+        bool roundUp = false;
+        for (pos++; pos < text.size(); pos++) {
+            if (places < Places) {
+                raw = raw * 10 + (text[pos] - '0');
+                places++;
+            } else {
+                roundUp = text[pos] >= '5';
+                break;
+            }
+        }
+        for (; places < Places; places++) raw *= 10;
+        raw += roundUp;
+        if (raw > std::numeric_limits<std::int64_t>::max()) throw std::overflow_error("Fixed-point overflow");
+        return Fixed::fromRaw(static_cast<std::int64_t>(raw));
+    }
+
+    // Integer exponents only; a negative one is the reciprocal
+    static Fixed power(Fixed base, Fixed exponent) {
+        if (!exponent.isInteger()) throw std::domain_error("Fixed-point exponent must be an integer");
+        std::int64_t n = exponent.rawValue() / Fixed::SCALE;
+        bool negative = n < 0;
+        std::uint64_t remaining = negative ? 0 - static_cast<std::uint64_t>(n) : static_cast<std::uint64_t>(n);
+        Fixed result = Fixed::fromInteger(1);
+        while (remaining) {
+            if (remaining & 1) result = result * base;
+            remaining >>= 1;
+            if (remaining) base = base * base;
+        }
+        return negative ? Fixed::fromInteger(1) / result : result;
+    }
+
+    static Fixed apply(Fixed a, Fixed b, OpCode op) {
+        switch (op) {
+            case OpCode::Add: return a + b;
+            case OpCode::Sub: return a - b;
+            case OpCode::Mul: return a * b;
+            case OpCode::Div: return a / b;
+            case OpCode::Mod: return a % b;
+            case OpCode::Pow: return power(a, b);
+            default:
+                throw std::runtime_error("Invalid operator");
+        }
+    }
+
+    // Always `Places` fractional digits, as amounts are usually printed
+    static void format(std::string& out, Fixed value) {
+        std::int64_t raw = value.rawValue();
+        std::uint64_t magnitude = raw < 0 ? 0 - static_cast<std::uint64_t>(raw) : static_cast<std::uint64_t>(raw);
+        if (raw < 0) out += '-';
+        out += std::to_string(magnitude / Fixed::SCALE);
+        if constexpr (Places > 0) {
+            std::string fraction = std::to_string(magnitude % Fixed::SCALE);
+            out += '.';
+            out.append(Places - fraction.size(), '0');
+            out += fraction;
+        }
+    }
+};
+
+#if CALC_ENABLE_GMP
+
+// Exact rationals of unbounded size from GMP. Every literal is exact, and
+// +, -, * and / never round.
+template <>
+struct NumericPolicy<mpq_class> {
+    static mpq_class parse(std::string_view text) {
+        size_t dot = text.find('.');
+        std::string digits(text.substr(0, dot));
+        std::string denominator = "1";
+        if (dot != std::string_view::npos) {
+            digits += text.substr(dot + 1);
+            denominator.append(text.size() - dot - 1, '0');
+        }
+        mpq_class value{mpz_class(digits), mpz_class(denominator)};
+        value.canonicalize();
+        return value;
+    }
+
+    // Integer exponents only; a negative one is the reciprocal
+    static mpq_class power(const mpq_class& base, const mpq_class& exponent) {
+        if (exponent.get_den() != 1 || !exponent.get_num().fits_slong_p()) {
+            throw std::domain_error("Rational exponent must be a machine-sized integer");
+        }
+        long n = exponent.get_num().get_si();
+        if (n < 0 && base == 0) throw std::runtime_error("Division by zero");
+        unsigned long e = n < 0 ? 0UL - static_cast<unsigned long>(n) : static_cast<unsigned long>(n);
+        mpz_class num, den;
+        mpz_pow_ui(num.get_mpz_t(), base.get_num().get_mpz_t(), e);
+        mpz_pow_ui(den.get_mpz_t(), base.get_den().get_mpz_t(), e);
+        mpq_class result = n < 0 ? mpq_class(den, num) : mpq_class(num, den);
+        result.canonicalize();
+        return result;
+    }
+
+    static mpq_class apply(const mpq_class& a, const mpq_class& b, OpCode op) {
+        switch (op) {
+            case OpCode::Add: return a + b;
+            case OpCode::Sub: return a - b;
+            case OpCode::Mul: return a * b;
+            case OpCode::Div:
+                if (b == 0) throw std::runtime_error("Division by zero");
+                return a / b;
+            case OpCode::Mod: {
+                // Remainder with the sign of the dividend, as in C
+                if (b == 0) throw std::runtime_error("Division by zero");
+                mpq_class quotient = a / b;
+                mpz_class truncated;
+                mpz_tdiv_q(truncated.get_mpz_t(), quotient.get_num().get_mpz_t(), quotient.get_den().get_mpz_t());
+                return a - b * mpq_class(truncated);
+            }
+            case OpCode::Pow: return power(a, b);
+            default:
+                throw std::runtime_error("Invalid operator");
+        }
+    }
+
+    // "n" for integers, "n/d" in lowest terms otherwise
+    static void format(std::string& out, const mpq_class& value) {
+        out += value.get_str();
+    }
+};
+
+#endif
+
+// Operator semantics for a policy type. The double overload in
+// operations.h is a better match for doubles, so they never come here.
+template <typename T>
+T applyOperation(const T& a, const T& b, OpCode op) {
+    return NumericPolicy<T>::apply(a, b, op);
+}
+
+// Bytecode compiled for a number type other than double. Each Push takes
+// its literal from `literals`, parsed from the source text by the type's
+// policy, so 0.1 is exactly one tenth for a decimal type.
+template <typename T>
+struct TypedProgram {
+    Program program;            // Push instructions index `literals`
+    std::vector<T> literals;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "program.h"
+
+using BinaryFunction = double (*)(double, double);
+
+// Parse-time properties of an operator character
+struct OperatorInfo {
+    OpCode op;
+    std::uint8_t precedence;        // Infix binding strength, 0 for non-operators
+    bool rightAssociative;
+    OpCode prefixOp;
+    std::uint8_t prefixPrecedence;  // Binding strength of the operand, 0 if never prefix
+};
+
+// Every operator is described once, in these tables: 256 entries indexed by
+// character for the lexer and parser, and 256 indexed by opcode for the
+// evaluators. A new operator is a new row here plus an opcode; the lexer,
+// parser and interpreter loops do not change. All tables are constexpr.
+class Operators {
+private:
+    static constexpr double add(double a, double b) { return a + b; }
+    static constexpr double subtract(double a, double b) { return a - b; }
+    static constexpr double multiply(double a, double b) { return a * b; }
+
+    // The standard only makes std::pow and std::fmod constexpr from C++26,
+    // so constant evaluation uses these instead. Each gives the bits the
+    // library gives at run time: a remainder is always exact, and a power
+    // is only folded when its result is.
+    static constexpr double INFINITY_VALUE = std::numeric_limits<double>::infinity();
+    static constexpr double MAX_EXACT_INTEGER = 9007199254740992.0;     // 2^53
+
+    // Whole exponents of whole bases, with every power an exact integer,
+    // and every power of zero. Zero follows std::pow: an odd whole
+    // exponent keeps the sign of the base, a negative one gives infinity.
+    static constexpr double constantPower(double a, double b) {
+        if (b == 0) return 1;
+        if (b == 1) return a;
+        double magnitude = b < 0 ? -b : b;
+        bool whole = magnitude <= MAX_EXACT_INTEGER && magnitude == static_cast<long long>(magnitude);
+        bool odd = whole && static_cast<long long>(magnitude) % 2;
+        if (a == 0 && (b < 0 || b > 0)) {
+            bool negative = std::bit_cast<std::uint64_t>(a) >> 63;
+            if (b > 0) return odd ? a : 0;
+            return odd && negative ? -INFINITY_VALUE : INFINITY_VALUE;
+        }
+        double base = a < 0 ? -a : a;
+        if (whole && base <= MAX_EXACT_INTEGER && a == static_cast<long long>(a)) {
+            double result = 1;
+            if (a == 1 || a == -1) return odd ? a : 1;
+            for (double n = 0; n < magnitude; n++) {
+                result *= a;
+                if (result > MAX_EXACT_INTEGER || result < -MAX_EXACT_INTEGER) {
+                    throw std::domain_error("Power is not exact at compile time");
+                }
+            }
+            if (b > 0) return result;
+            // A reciprocal is exact only for a power of two
+            double bits = result < 0 ? -result : result;
+            while (bits > 1 && static_cast<long long>(bits) % 2 == 0) bits /= 2;
+            if (bits == 1) return 1 / result;
+        }
+        throw std::domain_error("Power is not exact at compile time");
+    }
+
+    // Subtracts the largest doubling of |b| that fits until |a| < |b|.
+    // Each step is exact, because t <= r < 2t.
+    static constexpr double constantRemainder(double a, double b) {
+        if (a != a || b != b || a == INFINITY_VALUE || a == -INFINITY_VALUE) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        double r = a < 0 ? -a : a;
+        double m = b < 0 ? -b : b;
+        if (m == INFINITY_VALUE || r < m) return a;
+        while (r >= m) {
+            double t = m;
+            while (t + t <= r) t += t;
+            r -= t;
+        }
+        return a < 0 ? -r : r;
+    }
+
+    static constexpr double power(double a, double b) {
+        if consteval {
+            return constantPower(a, b);
+        }
+        return std::pow(a, b);
+    }
+
+    static constexpr double divide(double a, double b) {
+        if (b == 0) throw std::runtime_error("Division by zero");
+        return a / b;
+    }
+
+    // Remainder with the sign of the dividend, as in C
+    static constexpr double modulo(double a, double b) {
+        if (b == 0) throw std::runtime_error("Division by zero");
+        if consteval {
+            return constantRemainder(a, b);
+        }
+        return std::fmod(a, b);
+    }
+
+    static double invalid(double, double) {
+        throw std::runtime_error("Invalid operator");
+    }
+
+    struct Definition {
+        char symbol;
+        OpCode op;
+        std::uint8_t precedence;
+        bool rightAssociative;
+        BinaryFunction apply;
+        OpCode prefixOp;
+        std::uint8_t prefixPrecedence;
+    };
+
+    // Prefix minus binds tighter than '*' but looser than '^', so -2^2 is
+    // -(2^2) while 2^-1 is 2^(-1)
+    static constexpr Definition DEFINITIONS[] = {
+        {'+', OpCode::Add, 1, false, add, OpCode::Push, 0},
+        {'-', OpCode::Sub, 1, false, subtract, OpCode::Neg, 3},
+        {'*', OpCode::Mul, 2, false, multiply, OpCode::Push, 0},
+        {'/', OpCode::Div, 2, false, divide, OpCode::Push, 0},
+        {'%', OpCode::Mod, 2, false, modulo, OpCode::Push, 0},
+        {'^', OpCode::Pow, 4, true, power, OpCode::Push, 0},
+    };
+
+    using SymbolTable = std::array<OperatorInfo, 256>;
+    using FunctionTable = std::array<BinaryFunction, 256>;
+    using NameTable = std::array<char, 256>;
+
+    static constexpr SymbolTable makeSymbols() {
+        SymbolTable table{};
+        for (auto& entry : table) entry = {OpCode::Push, 0, false, OpCode::Push, 0};
+        for (const Definition& d : DEFINITIONS) {
+            table[static_cast<unsigned char>(d.symbol)] =
+                {d.op, d.precedence, d.rightAssociative, d.prefixOp, d.prefixPrecedence};
+        }
+        return table;
+    }
+
+    static constexpr FunctionTable makeFunctions() {
+        FunctionTable table{};
+        for (auto& entry : table) entry = invalid;
+        for (const Definition& d : DEFINITIONS) table[static_cast<std::uint8_t>(d.op)] = d.apply;
+        return table;
+    }
+
+    static constexpr NameTable makeNames() {
+        NameTable table{};
+        for (auto& entry : table) entry = '?';
+        for (const Definition& d : DEFINITIONS) {
+            table[static_cast<std::uint8_t>(d.op)] = d.symbol;
+            if (d.prefixPrecedence != 0) table[static_cast<std::uint8_t>(d.prefixOp)] = d.symbol;
+        }
+        return table;
+    }
+
+public:
+    static const SymbolTable SYMBOLS;
+    static const FunctionTable FUNCTIONS;
+    static const NameTable NAMES;
+
+    static constexpr const OperatorInfo& info(char c) {
+        return SYMBOLS[static_cast<unsigned char>(c)];
+    }
+
+    static constexpr bool isOperator(char c) {
+        return info(c).precedence != 0;
+    }
+
+    static constexpr bool isPrefix(char c) {
+        return info(c).prefixPrecedence != 0;
+    }
+
+    static constexpr OpCode opCode(char c) {
+        if (!isOperator(c)) throw std::runtime_error("Invalid operator");
+        return info(c).op;
+    }
+
+    // Source character of an operator opcode, '?' for anything else
+    static constexpr char symbol(OpCode op) {
+        return NAMES[static_cast<std::uint8_t>(op)];
+    }
+};
+
+inline constexpr Operators::SymbolTable Operators::SYMBOLS = Operators::makeSymbols();
+inline constexpr Operators::FunctionTable Operators::FUNCTIONS = Operators::makeFunctions();
+inline constexpr Operators::NameTable Operators::NAMES = Operators::makeNames();
+
+// Scalar semantics of the binary operators, shared by the interpreter and
+// the constant folder so both produce identical results and errors. Also
+// usable in constant expressions, with the same results.
+// Neg is a plain negation that the evaluators apply inline.
+constexpr double applyOperation(double a, double b, OpCode op) {
+    return Operators::FUNCTIONS[static_cast<std::uint8_t>(op)](a, b);
+}
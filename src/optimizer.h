@@ -0,0 +1,224 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "operations.h"
+#include "program.h"
+
+// Rewrites a program through an expression DAG. Postfix code is rebuilt
+// bottom-up with hash-consing, so structurally identical subexpressions
+// become one node. While building, literal-only operations are folded and
+// these identities are applied:
+//   x+(-0), (-0)+x, x-0, x*1, 1*x, x/1, x^1  ->  x
+//   x^2                                       ->  x*x
+//   --x                                       ->  x
+//   x+-y, x--y                                ->  x-y, x+y
+// x+0 is kept: for x = -0 it is +0, not x.
+// A division or remainder by a constant zero is never folded, so the
+// error still surfaces when the program runs. Nodes used more than once
+// are computed once into a temporary and reloaded afterwards.
+class Optimizer {
+private:
+    static constexpr std::uint32_t NONE = static_cast<std::uint32_t>(-1);
+
+    struct Node {
+        OpCode op;
+        std::uint32_t index;    // Variable slot for Load
+        double value;           // Literal for Push
+        std::uint32_t left;     // Operand of Neg
+        std::uint32_t right;
+    };
+
+    using NodeKey = std::tuple<OpCode, std::uint32_t, std::uint64_t, std::uint32_t, std::uint32_t>;
+
+    std::vector<Node> nodes;
+    std::map<NodeKey, std::uint32_t> unique;
+
+    // Emission state
+    std::vector<std::uint32_t> uses;
+    std::vector<std::uint32_t> tempSlot;
+    Program* output = nullptr;
+    size_t depth = 0;
+
+    std::uint32_t makeNode(const Node& node) {
+        NodeKey key{node.op, node.index, std::bit_cast<std::uint64_t>(node.value), node.left, node.right};
+        auto it = unique.find(key);
+        if (it != unique.end()) return it->second;
+        std::uint32_t id = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(node);
+        unique.emplace(key, id);
+        return id;
+    }
+
+    std::uint32_t constant(double value) {
+        return makeNode({OpCode::Push, 0, value, NONE, NONE});
+    }
+
+    bool isConstant(std::uint32_t id, double value) const {
+        return nodes[id].op == OpCode::Push && nodes[id].value == value;
+    }
+
+    // Same bits, so a -0 literal is not +0
+    bool isExactly(std::uint32_t id, double value) const {
+        return nodes[id].op == OpCode::Push &&
+               std::bit_cast<std::uint64_t>(nodes[id].value) == std::bit_cast<std::uint64_t>(value);
+    }
+
+    std::uint32_t negate(std::uint32_t a) {
+        const Node& x = nodes[a];
+        if (x.op == OpCode::Push) return constant(-x.value);
+        if (x.op == OpCode::Neg) return x.left;
+        return makeNode({OpCode::Neg, 0, 0, a, NONE});
+    }
+
+    std::uint32_t binary(OpCode op, std::uint32_t a, std::uint32_t b) {
+        const Node& x = nodes[a];
+        const Node& y = nodes[b];
+        if (x.op == OpCode::Push && y.op == OpCode::Push && !((op == OpCode::Div || op == OpCode::Mod) && y.value == 0)) {
+            return constant(applyOperation(x.value, y.value, op));
+        }
+
+        switch (op) {
+            case OpCode::Add:
+                if (isExactly(b, -0.0)) return a;
+                if (isExactly(a, -0.0)) return b;
+                if (y.op == OpCode::Neg) return makeNode({OpCode::Sub, 0, 0, a, y.left});
+                break;
+            case OpCode::Sub:
+                if (isExactly(b, 0.0)) return a;
+                if (y.op == OpCode::Neg) return makeNode({OpCode::Add, 0, 0, a, y.left});
+                break;
+            case OpCode::Mul:
+                if (isConstant(b, 1)) return a;
+                if (isConstant(a, 1)) return b;
+                break;
+            case OpCode::Div:
+                if (isConstant(b, 1)) return a;
+                break;
+            case OpCode::Pow:
+                if (isConstant(b, 1)) return a;
+                if (isConstant(b, 2)) return makeNode({OpCode::Mul, 0, 0, a, a});
+                break;
+            default:
+                break;
+        }
+        return makeNode({op, 0, 0, a, b});
+    }
+
+    std::uint32_t buildGraph(const Program& program) {
+        std::vector<std::uint32_t> stack;
+        std::vector<std::uint32_t> temps(program.tempCount, NONE);
+        for (const Instruction& instr : program.code) {
+            switch (instr.op) {
+                case OpCode::Push:
+                    stack.push_back(constant(instr.value));
+                    break;
+                case OpCode::Load:
+                    stack.push_back(makeNode({OpCode::Load, instr.index, 0, NONE, NONE}));
+                    break;
+                case OpCode::StoreTemp:
+                    temps[instr.index] = stack.back();
+                    break;
+                case OpCode::LoadTemp:
+                    stack.push_back(temps[instr.index]);
+                    break;
+                case OpCode::Neg:
+                    stack.back() = negate(stack.back());
+                    break;
+                default: {
+                    std::uint32_t b = stack.back();
+                    stack.pop_back();
+                    stack.back() = binary(instr.op, stack.back(), b);
+                    break;
+                }
+            }
+        }
+        return stack.back();
+    }
+
+    // The walks below keep their own stacks: a long operator chain is a
+    // tree as deep as the chain is long
+    void countUses(std::uint32_t root) {
+        std::vector<std::uint32_t> pending{root};
+        while (!pending.empty()) {
+            std::uint32_t id = pending.back();
+            pending.pop_back();
+            if (uses[id]++ > 0) continue;
+            if (nodes[id].left != NONE) pending.push_back(nodes[id].left);
+            if (nodes[id].right != NONE) pending.push_back(nodes[id].right);
+        }
+    }
+
+    void emit(OpCode op, std::uint32_t index = 0, double value = 0) {
+        output->code.push_back({op, index, value});
+        if (op == OpCode::Push || op == OpCode::Load || op == OpCode::LoadTemp) {
+            depth++;
+            if (depth > output->maxDepth) output->maxDepth = depth;
+        } else if (op != OpCode::StoreTemp && op != OpCode::Neg) {
+            depth--;
+        }
+    }
+
+    // Postfix emission; a node is revisited to emit its operator once both
+    // operands are on the stack
+    void emitNode(std::uint32_t root) {
+        std::vector<std::pair<std::uint32_t, bool>> pending{{root, false}};
+        while (!pending.empty()) {
+            auto [id, operandsDone] = pending.back();
+            pending.pop_back();
+            const Node& node = nodes[id];
+            if (operandsDone) {
+                emit(node.op);
+                if (uses[id] > 1) {
+                    tempSlot[id] = static_cast<std::uint32_t>(output->tempCount++);
+                    emit(OpCode::StoreTemp, tempSlot[id]);
+                }
+                continue;
+            }
+            if (tempSlot[id] != NONE) {
+                emit(OpCode::LoadTemp, tempSlot[id]);
+                continue;
+            }
+            if (node.left == NONE) {
+                // Leaves are cheaper to repeat than to keep in a temporary
+                emit(node.op, node.index, node.value);
+                continue;
+            }
+            pending.push_back({id, true});
+            if (node.right != NONE) pending.push_back({node.right, false});
+            pending.push_back({node.left, false});
+        }
+    }
+
+public:
+    // Most the optimizer allocates per input instruction: a node, its
+    // hash-consing entry, its use count and temporary slot and its place on
+    // the build and emission stacks
+    static constexpr size_t BYTES_PER_INSTRUCTION =
+        sizeof(Node) + sizeof(std::map<NodeKey, std::uint32_t>::value_type) + 4 * sizeof(void*) +
+        4 * sizeof(std::uint32_t) + sizeof(std::pair<std::uint32_t, bool>);
+
+    Program optimize(const Program& program) {
+        nodes.clear();
+        unique.clear();
+        std::uint32_t root = buildGraph(program);
+
+        Program result;
+        result.variables = program.variables;
+        uses.assign(nodes.size(), 0);
+        tempSlot.assign(nodes.size(), NONE);
+        output = &result;
+        depth = 0;
+
+        countUses(root);
+        emitNode(root);
+        output = nullptr;
+        return result;
+    }
+};
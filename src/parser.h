@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "eval_error.h"
+#include "lexer.h"
+#include "operations.h"
+#include "program.h"
+
+// Pratt parser over a validated token stream. One left-to-right pass puts
+// operands and operators in postfix order: binding strength and
+// associativity come from the Operators table, and an operator token in
+// operand position is a prefix operator. Everything here is constexpr so
+// the same parse runs at compile time too.
+class Parser {
+private:
+    template <typename Emit>
+    struct Pass {
+        const std::vector<Token>& tokens;
+        Emit& emit;
+        size_t maxDepth;
+        size_t pos = 0;
+        size_t depth = 0;
+        bool tooDeep = false;       // Set at the limit; every level then returns
+        size_t tooDeepAt = 0;       // Offset of the token that went past it
+
+        constexpr void put(OpCode op, const Token& token) {
+            if constexpr (std::is_invocable_v<Emit&, OpCode, const Token&, size_t>) {
+                emit(op, token, depth);
+            } else {
+                emit(op, token);
+            }
+        }
+
+        // Operand: a literal, a variable, a bracketed group or a prefix
+        // operator applied to an operand
+        constexpr void prefix() {
+            const Token& token = tokens[pos++];
+            switch (token.kind) {
+                case TokenKind::Number:
+                    put(OpCode::Push, token);
+                    break;
+                case TokenKind::Variable:
+                    put(OpCode::Load, token);
+                    break;
+                case TokenKind::OpenBracket:
+                    expression(1);
+                    pos++;      // The matching closing bracket
+                    break;
+                default: {
+                    const OperatorInfo& info = Operators::info(token.symbol);
+                    expression(info.prefixPrecedence);
+                    if (tooDeep) return;
+                    put(info.prefixOp, token);
+                    break;
+                }
+            }
+        }
+
+        // Parses an operand followed by every infix operator binding at
+        // least as tightly as `minPrecedence`
+        constexpr void expression(int minPrecedence) {
+            if (depth == maxDepth) {
+                tooDeep = true;
+                tooDeepAt = tokens[pos].offset;
+                return;
+            }
+            depth++;
+            prefix();
+            while (!tooDeep && pos < tokens.size() && tokens[pos].kind == TokenKind::Operator) {
+                const Token& token = tokens[pos];
+                const OperatorInfo& info = Operators::info(token.symbol);
+                if (info.precedence < minPrecedence) break;
+                pos++;
+                expression(info.rightAssociative ? info.precedence : info.precedence + 1);
+                if (tooDeep) return;
+                put(info.op, token);
+            }
+            depth--;
+        }
+    };
+
+public:
+    // Brackets, prefix operators and right-associative chains each recurse
+    // once; this many levels stay well inside a default thread stack
+    static constexpr size_t MAX_DEPTH = 10000;
+
+    // Calls `emit(op, token)` in evaluation order: Push for a Number, Load
+    // for a Variable, and the operator's opcode for an Operator token. The
+    // lexer guarantees the token stream is well formed. Nesting deeper than
+    // `maxDepth` stops the parse, with only part of the program emitted,
+    // and is returned as an error; the stack never grows past it. An
+    // `emit` taking a third argument also gets the nesting depth of the
+    // token, 1 at the top level.
+    template <typename Emit>
+    static constexpr std::optional<EvalError> tryToPostfix(const std::vector<Token>& tokens, Emit&& emit,
+                                                           size_t maxDepth = MAX_DEPTH) {
+        Pass<Emit> pass{tokens, emit, maxDepth};
+        pass.expression(1);
+        if (pass.tooDeep) return EvalError{EvalErrorCode::NestedTooDeeply, pass.tooDeepAt};
+        return std::nullopt;
+    }
+
+    // Throwing form of tryToPostfix()
+    template <typename Emit>
+    static constexpr void toPostfix(const std::vector<Token>& tokens, Emit&& emit, size_t maxDepth = MAX_DEPTH) {
+        if (std::optional<EvalError> error = tryToPostfix(tokens, emit, maxDepth)) {
+            throw std::invalid_argument(error->message());
+        }
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CodeProfile;
+struct FusedCode;
+struct JitTier;
+
+// Opcode values are part of the program file format (program_file.h): new
+// opcodes go at the end, and any renumbering bumps the file version.
+enum class OpCode : std::uint8_t {
+    Push,       // Push the instruction's literal value
+    Load,       // Push the input bound to variable slot `index`
+    StoreTemp,  // Copy the top of the stack into temporary `index`
+    LoadTemp,   // Push temporary `index`
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    Pow,
+    Neg,        // Negate the top of the stack
+
+    // Superinstructions, found only in fused interpreter code (fusion.h)
+    MulAdd,     // a b c -> a*b + c
+    AddMul,     // c a b -> c + a*b
+    Square,
+    Cube,
+    Sum         // Adds the top `index` values, deepest first
+};
+
+// Opcodes a Program's code and a program file may hold
+inline constexpr size_t OPCODE_COUNT = static_cast<size_t>(OpCode::Neg) + 1;
+
+struct Instruction {
+    OpCode op;
+    std::uint32_t index;    // Variable slot or temporary
+    double value;           // Literal for Push
+};
+
+// A compiled expression: flat postfix bytecode for a value stack machine.
+// Programs are immutable once compiled and can be run any number of times.
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<std::string> variables;     // Slot names, in order of first use
+    size_t maxDepth = 0;                    // Deepest value stack the code needs
+    size_t tempCount = 0;                   // Temporaries for shared subexpressions
+    std::shared_ptr<const FusedCode> fused; // Interpreter code with superinstructions, for cached programs
+    std::shared_ptr<JitTier> tier;          // Native code tier, attached to cached programs
+    std::shared_ptr<const CodeProfile> profile;     // Run counter increments, with stats enabled
+
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    size_t variableIndex(std::string_view name) const {
+        for (size_t i = 0; i < variables.size(); i++) {
+            if (variables[i] == name) return i;
+        }
+        return npos;
+    }
+};
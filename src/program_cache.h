@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "program.h"
+
+struct CacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    size_t entries = 0;
+};
+
+// Bounded LRU map from expression text to its compiled program. Keys are
+// split across independently locked shards so concurrent lookups of
+// different formulas rarely meet on the same mutex, and lookups by
+// string_view never allocate.
+class ProgramCache {
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    using Entry = std::pair<std::string, std::shared_ptr<const Program>>;
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> order;     // Most recently used first
+        // Keys view the strings owned by `order`, whose nodes never move
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+    };
+
+    size_t shardCapacity;
+    std::array<Shard, SHARD_COUNT> shards;
+
+    Shard& shardFor(std::string_view key) {
+        return shards[std::hash<std::string_view>{}(key) % SHARD_COUNT];
+    }
+
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+public:
+    explicit ProgramCache(size_t capacity = 4096)
+        : shardCapacity(capacity / SHARD_COUNT ? capacity / SHARD_COUNT : 1) {}
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    // Cache key for an expression: surrounding whitespace is dropped.
+    // Whitespace inside an expression is already a syntax error, so
+    // inputs that differ only in padding share one entry.
+    static std::string_view normalize(std::string_view expression) {
+        while (!expression.empty() && isSpace(expression.front())) expression.remove_prefix(1);
+        while (!expression.empty() && isSpace(expression.back())) expression.remove_suffix(1);
+        return expression;
+    }
+
+    // Returns the cached program for `expression`, or null on a miss
+    std::shared_ptr<const Program> find(std::string_view expression) {
+        std::string_view key = normalize(expression);
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            shard.misses++;
+            return nullptr;
+        }
+        shard.hits++;
+        shard.order.splice(shard.order.begin(), shard.order, it->second);
+        return it->second->second;
+    }
+
+    // Stores a program, evicting the least recently used entry of the shard
+    // when it is full. If another thread stored the same key first, that
+    // program is kept and returned.
+    std::shared_ptr<const Program> insert(std::string_view expression, std::shared_ptr<const Program> program) {
+        std::string_view key = normalize(expression);
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            return it->second->second;
+        }
+
+        shard.order.emplace_front(std::string(key), std::move(program));
+        shard.index.emplace(shard.order.front().first, shard.order.begin());
+        if (shard.order.size() > shardCapacity) {
+            shard.index.erase(shard.order.back().first);
+            shard.order.pop_back();
+            shard.evictions++;
+        }
+        return shard.order.front().second;
+    }
+
+    // Looks the expression up and compiles it outside the lock on a miss.
+    // Expressions that fail to compile are not cached.
+    template <typename Compile>
+    std::shared_ptr<const Program> getOrCompile(std::string_view expression, Compile&& compile) {
+        if (auto program = find(expression)) return program;
+        return insert(expression, std::make_shared<const Program>(compile(expression)));
+    }
+
+    CacheStats stats() {
+        CacheStats total;
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.hits;
+            total.misses += shard.misses;
+            total.evictions += shard.evictions;
+            total.entries += shard.order.size();
+        }
+        return total;
+    }
+
+    void clear() {
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.index.clear();
+            shard.order.clear();
+        }
+    }
+};
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "program.h"
+#include "program_cache.h"
+
+// Flat file of compiled programs, written offline by `program --compile`
+// and used in place after mmap: opening a file checks it once, and no
+// program is ever parsed, copied or allocated. Every offset is relative
+// to the start of the file, so a mapping works at any address.
+//
+// Layout, all little-endian:
+//   FileHeader
+//   FileEntry[count]          Sorted by source text for binary search
+//   Instruction[]             Each program's code, 16 bytes per instruction
+//   NameRecord[]              Each program's variable names
+//   char[]                    Source texts and variable names
+//
+// Instructions are stored exactly as the in-memory Instruction struct
+// lays them out, which is what lets a view execute straight from the file.
+namespace program_file {
+
+inline constexpr char MAGIC[8] = {'C', 'A', 'L', 'C', 'P', 'R', 'O', 'G'};
+inline constexpr std::uint32_t VERSION = 1;
+
+struct FileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t opcodeCount;      // OPCODE_COUNT of the writer
+    std::uint64_t size;             // Whole file, in bytes
+    std::uint32_t count;            // Programs
+    std::uint32_t reserved;
+};
+
+struct FileEntry {
+    std::uint64_t codeOffset;
+    std::uint64_t namesOffset;
+    std::uint64_t sourceOffset;
+    std::uint32_t codeCount;
+    std::uint32_t variableCount;
+    std::uint32_t sourceLength;
+    std::uint32_t maxDepth;
+    std::uint32_t tempCount;
+    std::uint32_t reserved;
+};
+
+struct NameRecord {
+    std::uint32_t offset;
+    std::uint32_t length;
+};
+
+static_assert(sizeof(FileHeader) == 32 && sizeof(FileEntry) == 48 && sizeof(NameRecord) == 8);
+static_assert(sizeof(Instruction) == 16 && offsetof(Instruction, op) == 0 &&
+              offsetof(Instruction, index) == 4 && offsetof(Instruction, value) == 8,
+              "Instruction no longer matches the program file record");
+static_assert(std::endian::native == std::endian::little, "Program files are little-endian");
+
+}  // namespace program_file
+
+// A compiled program that lives in someone else's memory, usually a mapped
+// ProgramFile. Cheap to copy; the memory must outlive the view.
+class ProgramView {
+private:
+    const char* base = nullptr;
+    std::span<const program_file::NameRecord> names;
+
+public:
+    std::span<const Instruction> code;
+    size_t maxDepth = 0;
+    size_t tempCount = 0;
+
+    ProgramView() = default;
+
+    ProgramView(const char* base, const program_file::FileEntry& entry)
+        : base(base),
+          names(reinterpret_cast<const program_file::NameRecord*>(base + entry.namesOffset), entry.variableCount),
+          code(reinterpret_cast<const Instruction*>(base + entry.codeOffset), entry.codeCount),
+          maxDepth(entry.maxDepth),
+          tempCount(entry.tempCount) {}
+
+    size_t variableCount() const {
+        return names.size();
+    }
+
+    std::string_view variable(size_t slot) const {
+        return {base + names[slot].offset, names[slot].length};
+    }
+
+    // Owning copy, for the batch and native paths that take a Program
+    Program toProgram() const {
+        Program program;
+        program.code.assign(code.begin(), code.end());
+        for (size_t i = 0; i < variableCount(); i++) program.variables.emplace_back(variable(i));
+        program.maxDepth = maxDepth;
+        program.tempCount = tempCount;
+        return program;
+    }
+};
+
+// Builds a program file in memory. Sources are keyed like the program
+// cache, without surrounding whitespace; a repeated source keeps its first
+// program.
+class ProgramWriter {
+private:
+    std::vector<std::pair<std::string, Program>> programs;
+
+    template <typename T>
+    static void put(std::string& out, size_t offset, const T& value) {
+        std::memcpy(out.data() + offset, &value, sizeof(T));
+    }
+
+public:
+    void add(std::string_view source, Program program) {
+        program.tier.reset();
+        programs.emplace_back(std::string(ProgramCache::normalize(source)), std::move(program));
+    }
+
+    size_t size() const {
+        return programs.size();
+    }
+
+    std::string finish() {
+        using namespace program_file;
+
+        std::stable_sort(programs.begin(), programs.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        programs.erase(std::unique(programs.begin(), programs.end(),
+                                   [](const auto& a, const auto& b) { return a.first == b.first; }),
+                       programs.end());
+
+        size_t codeBytes = 0, nameBytes = 0, textBytes = 0;
+        for (const auto& [source, program] : programs) {
+            codeBytes += program.code.size() * sizeof(Instruction);
+            nameBytes += program.variables.size() * sizeof(NameRecord);
+            textBytes += source.size();
+            for (const std::string& name : program.variables) textBytes += name.size();
+        }
+        size_t codeAt = sizeof(FileHeader) + programs.size() * sizeof(FileEntry);
+        size_t namesAt = codeAt + codeBytes;
+        size_t textAt = namesAt + nameBytes;
+        if (textAt + textBytes > UINT32_MAX) throw std::length_error("Program file too large");
+
+        std::string out(textAt + textBytes, '\0');
+        FileHeader header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.opcodeCount = OPCODE_COUNT;
+        header.size = out.size();
+        header.count = static_cast<std::uint32_t>(programs.size());
+        put(out, 0, header);
+
+        for (size_t i = 0; i < programs.size(); i++) {
+            const auto& [source, program] = programs[i];
+            FileEntry entry{};
+            entry.codeOffset = codeAt;
+            entry.namesOffset = namesAt;
+            entry.sourceOffset = textAt;
+            entry.codeCount = static_cast<std::uint32_t>(program.code.size());
+            entry.variableCount = static_cast<std::uint32_t>(program.variables.size());
+            entry.sourceLength = static_cast<std::uint32_t>(source.size());
+            entry.maxDepth = static_cast<std::uint32_t>(program.maxDepth);
+            entry.tempCount = static_cast<std::uint32_t>(program.tempCount);
+            put(out, sizeof(FileHeader) + i * sizeof(FileEntry), entry);
+
+            source.copy(out.data() + textAt, source.size());
+            textAt += source.size();
+            // Field by field, so padding bytes are always zero
+            for (const Instruction& instr : program.code) {
+                put(out, codeAt + offsetof(Instruction, op), instr.op);
+                put(out, codeAt + offsetof(Instruction, index), instr.index);
+                put(out, codeAt + offsetof(Instruction, value), instr.value);
+                codeAt += sizeof(Instruction);
+            }
+            for (const std::string& name : program.variables) {
+                put(out, namesAt, NameRecord{static_cast<std::uint32_t>(textAt),
+                                             static_cast<std::uint32_t>(name.size())});
+                namesAt += sizeof(NameRecord);
+                name.copy(out.data() + textAt, name.size());
+                textAt += name.size();
+            }
+        }
+        programs.clear();
+        return out;
+    }
+};
+
+// Read-only index over a program file held in memory. Construction checks
+// the header, every offset and every program's stack discipline once, so
+// views of a file that opened are as safe to run as compiled programs.
+class ProgramFile {
+private:
+    const char* base = nullptr;
+    std::span<const program_file::FileEntry> entries;
+
+    [[noreturn]] static void invalid() {
+        throw std::runtime_error("Invalid program file");
+    }
+
+    static bool inside(size_t size, std::uint64_t offset, std::uint64_t bytes) {
+        return offset <= size && bytes <= size - offset;
+    }
+
+    // Replays the stack effects so no instruction can leave its buffers or
+    // read a temporary before it is stored
+    static void checkCode(const ProgramView& view) {
+        // Every slot and temporary is written by some instruction
+        if (view.maxDepth > view.code.size() || view.tempCount > view.code.size()) invalid();
+        std::vector<bool> stored(view.tempCount);
+        size_t top = 0;
+        for (const Instruction& instr : view.code) {
+            auto op = static_cast<size_t>(instr.op);
+            if (op >= OPCODE_COUNT) invalid();
+            switch (instr.op) {
+                case OpCode::Push:
+                    top++;
+                    break;
+                case OpCode::Load:
+                    if (instr.index >= view.variableCount()) invalid();
+                    top++;
+                    break;
+                case OpCode::LoadTemp:
+                    if (instr.index >= view.tempCount || !stored[instr.index]) invalid();
+                    top++;
+                    break;
+                case OpCode::StoreTemp:
+                    if (instr.index >= view.tempCount || top < 1) invalid();
+                    stored[instr.index] = true;
+                    break;
+                case OpCode::Neg:
+                    if (top < 1) invalid();
+                    break;
+                default:
+                    if (top < 2) invalid();
+                    top--;
+                    break;
+            }
+            if (top > view.maxDepth) invalid();
+        }
+        if (top != 1) invalid();
+    }
+
+public:
+    ProgramFile() = default;
+
+    // `bytes` must be 8-byte aligned, as any mapping or heap buffer is
+    explicit ProgramFile(std::span<const char> bytes) {
+        using namespace program_file;
+
+        FileHeader header;
+        if (bytes.size() < sizeof(header)) invalid();
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) invalid();
+        if (header.version != VERSION || header.opcodeCount != OPCODE_COUNT) {
+            throw std::runtime_error("Unsupported program file version");
+        }
+        if (header.size != bytes.size()) invalid();
+        if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(Instruction) != 0) invalid();
+        if (!inside(bytes.size(), sizeof(header), std::uint64_t{header.count} * sizeof(FileEntry))) invalid();
+
+        base = bytes.data();
+        entries = {reinterpret_cast<const FileEntry*>(base + sizeof(header)), header.count};
+        for (const FileEntry& entry : entries) {
+            if (entry.codeOffset % alignof(Instruction) != 0 || entry.namesOffset % alignof(NameRecord) != 0 ||
+                !inside(bytes.size(), entry.codeOffset, std::uint64_t{entry.codeCount} * sizeof(Instruction)) ||
+                !inside(bytes.size(), entry.namesOffset, std::uint64_t{entry.variableCount} * sizeof(NameRecord)) ||
+                !inside(bytes.size(), entry.sourceOffset, entry.sourceLength)) {
+                invalid();
+            }
+            ProgramView view(base, entry);
+            for (size_t slot = 0; slot < view.variableCount(); slot++) {
+                const NameRecord& name = reinterpret_cast<const NameRecord*>(base + entry.namesOffset)[slot];
+                if (!inside(bytes.size(), name.offset, name.length)) invalid();
+            }
+            checkCode(view);
+        }
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    std::string_view source(size_t i) const {
+        return {base + entries[i].sourceOffset, entries[i].sourceLength};
+    }
+
+    ProgramView operator[](size_t i) const {
+        return ProgramView(base, entries[i]);
+    }
+
+    // Binary search by source text; false if the file does not have it
+    bool find(std::string_view expression, ProgramView& view) const {
+        std::string_view key = ProgramCache::normalize(expression);
+        size_t low = 0, high = entries.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (source(mid) < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low == entries.size() || source(low) != key) return false;
+        view = (*this)[low];
+        return true;
+    }
+};
+
+// A program file mapped read-only for the lifetime of the object
+class MappedProgramFile {
+private:
+    void* data = nullptr;
+    size_t length = 0;
+    ProgramFile index;
+
+public:
+    explicit MappedProgramFile(const char* path) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error(std::string("Cannot open ") + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            throw std::runtime_error("Invalid program file");
+        }
+        length = static_cast<size_t>(info.st_size);
+        data = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) throw std::runtime_error(std::string("Cannot map ") + path);
+        try {
+            index = ProgramFile({static_cast<const char*>(data), length});
+        } catch (...) {
+            ::munmap(data, length);
+            throw;
+        }
+    }
+
+    MappedProgramFile(const MappedProgramFile&) = delete;
+    MappedProgramFile& operator=(const MappedProgramFile&) = delete;
+
+    ~MappedProgramFile() {
+        ::munmap(data, length);
+    }
+
+    const ProgramFile& programs() const {
+        return index;
+    }
+};
@@ -0,0 +1,427 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "calculator.h"
+#include "program_cache.h"
+
+// Where a Server listens: "unix:<path>", "<host>:<port>" or just "<port>"
+// on the loopback interface
+struct Endpoint {
+    bool local = false;         // Unix domain socket
+    std::string host = "127.0.0.1";
+    std::string port;
+    std::string path;
+
+    static Endpoint parse(std::string_view text) {
+        Endpoint endpoint;
+        if (text.substr(0, 5) == "unix:") {
+            endpoint.local = true;
+            endpoint.path = text.substr(5);
+            if (endpoint.path.empty() || endpoint.path.size() >= sizeof(sockaddr_un::sun_path)) {
+                throw std::invalid_argument("Invalid socket path");
+            }
+            return endpoint;
+        }
+        size_t colon = text.rfind(':');
+        if (colon != std::string_view::npos) {
+            endpoint.host = text.substr(0, colon);
+            text.remove_prefix(colon + 1);
+        }
+        if (text.empty() || text.find_first_not_of("0123456789") != std::string_view::npos) {
+            throw std::invalid_argument("Invalid port");
+        }
+        endpoint.port = text;
+        return endpoint;
+    }
+};
+
+// Long-running evaluation server. Clients send length-prefixed frames, each
+// a 4-byte little-endian length followed by that many bytes of expression,
+// and may pipeline any number of them without waiting. Each request gets
+// one response frame in request order: a 4-byte little-endian length, a
+// status byte (0 for a result, 1 for an error) and the result or error
+// message as text.
+//
+// Every event loop thread owns its epoll set, its connections and a small
+// front cache of compiled programs, so a request touches no lock unless it
+// misses that cache and falls through to the Calculator's shared one. All
+// responses produced by one read are sent with one write.
+class Server {
+public:
+    static constexpr char STATUS_OK = 0;
+    static constexpr char STATUS_ERROR = 1;
+
+private:
+    static constexpr size_t HEADER_BYTES = 4;
+    static constexpr std::uint32_t MAX_FRAME_BYTES = 1 << 20;
+    static constexpr size_t READ_BYTES = 64 * 1024;
+    static constexpr int MAX_EVENTS = 64;
+    static constexpr size_t LOCAL_CACHE_CAPACITY = 1024;
+
+    struct Connection {
+        int fd;
+        std::vector<char> input;
+        std::string output;
+        size_t written = 0;
+        bool waitingToWrite = false;    // Reads pause until output drains
+        bool peerClosed = false;        // Closed once the last answer is sent
+    };
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const {
+            return std::hash<std::string_view>{}(text);
+        }
+    };
+
+    using LocalCache = std::unordered_map<std::string, std::shared_ptr<const Program>,
+                                          StringHash, std::equal_to<>>;
+
+    // Distinguishes the two shared descriptors from connections in epoll data
+    static inline char LISTENER_TAG;
+    static inline char WAKE_TAG;
+
+    class Loop {
+    private:
+        Server& server;
+        int epollFd;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        LocalCache programs;
+
+        void watch(int fd, std::uint32_t events, void* data, int operation) {
+            epoll_event event{};
+            event.events = events;
+            event.data.ptr = data;
+            if (::epoll_ctl(epollFd, operation, fd, &event) != 0) {
+                throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+            }
+        }
+
+        // The loop's own copy of the shared cache entry, so repeated
+        // formulas never reach the shard locks
+        std::expected<const Program*, EvalError> program(std::string_view key) {
+            auto it = programs.find(key);
+            if (it != programs.end()) return it->second.get();
+
+            std::expected<std::shared_ptr<const Program>, EvalError> compiled = server.calc.tryCompileCached(key);
+            if (!compiled) return std::unexpected(compiled.error());
+            if (programs.size() >= LOCAL_CACHE_CAPACITY) programs.clear();
+            return programs.emplace(std::string(key), std::move(*compiled)).first->second.get();
+        }
+
+        // Malformed requests are answered without throwing
+        std::expected<double, EvalError> evaluate(std::string_view key) {
+            std::expected<const Program*, EvalError> compiled = program(key);
+            if (!compiled) return std::unexpected(compiled.error());
+            const Program& code = **compiled;
+            if (!code.variables.empty()) {
+                // Slot 0 is the first identifier in the text, so the first match is it
+                return std::unexpected(EvalError{EvalErrorCode::UnboundVariable, key.find(code.variables[0])});
+            }
+            return server.calc.tryRun(code);
+        }
+
+        void respond(std::string_view expression, std::string& output) {
+            size_t header = output.size();
+            output.append(HEADER_BYTES + 1, STATUS_OK);
+            std::string_view key = ProgramCache::normalize(expression);
+            try {
+                std::expected<double, EvalError> result = evaluate(key);
+                if (result) {
+                    server.calc.formatResult(output, *result);
+                } else {
+                    output[header + HEADER_BYTES] = STATUS_ERROR;
+                    output += server.calc.describe(result.error(), key);
+                }
+            } catch (const std::exception& e) {
+                output.resize(header + HEADER_BYTES + 1);
+                output[header + HEADER_BYTES] = STATUS_ERROR;
+                output += e.what();
+            }
+            encodeLength(output.data() + header, static_cast<std::uint32_t>(output.size() - header - HEADER_BYTES));
+        }
+
+        // Answers every complete frame in the input buffer. False if the
+        // client announced a frame larger than the server accepts.
+        bool processFrames(Connection& connection) {
+            std::vector<char>& input = connection.input;
+            size_t pos = 0;
+            bool ok = true;
+            while (input.size() - pos >= HEADER_BYTES) {
+                std::uint32_t length = decodeLength(input.data() + pos);
+                if (length > MAX_FRAME_BYTES) {
+                    ok = false;
+                    break;
+                }
+                if (input.size() - pos - HEADER_BYTES < length) break;
+                respond(std::string_view(input.data() + pos + HEADER_BYTES, length), connection.output);
+                pos += HEADER_BYTES + length;
+            }
+            input.erase(input.begin(), input.begin() + static_cast<std::ptrdiff_t>(pos));
+            return ok;
+        }
+
+        // Sends as much pending output as the socket takes. False if the
+        // connection is broken.
+        bool flush(Connection& connection) {
+            std::string& output = connection.output;
+            while (connection.written < output.size()) {
+                ssize_t sent = ::send(connection.fd, output.data() + connection.written,
+                                      output.size() - connection.written, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    return false;
+                }
+                connection.written += static_cast<size_t>(sent);
+            }
+
+            bool pending = connection.written < output.size();
+            if (!pending) {
+                output.clear();
+                connection.written = 0;
+            }
+            if (pending != connection.waitingToWrite) {
+                connection.waitingToWrite = pending;
+                watch(connection.fd, pending ? EPOLLOUT : EPOLLIN, &connection, EPOLL_CTL_MOD);
+            }
+            return true;
+        }
+
+        // False once the connection should be closed
+        bool readFrames(Connection& connection) {
+            std::vector<char>& input = connection.input;
+            size_t used = input.size();
+            input.resize(used + READ_BYTES);
+            ssize_t count;
+            do {
+                count = ::recv(connection.fd, input.data() + used, READ_BYTES, 0);
+            } while (count < 0 && errno == EINTR);
+            input.resize(used + static_cast<size_t>(count > 0 ? count : 0));
+
+            if (count < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+            // A client that half-closes still gets every answer it asked for
+            connection.peerClosed = count == 0;
+            bool ok = processFrames(connection);
+            return flush(connection) && ok && (count > 0 || connection.waitingToWrite);
+        }
+
+        void close(Connection& connection) {
+            ::close(connection.fd);
+            connections.erase(connection.fd);
+        }
+
+        void acceptAll() {
+            while (true) {
+                int fd = ::accept4(server.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    return;     // EAGAIN: another loop took it, or nothing left
+                }
+                if (!server.endpoint.local) {
+                    int on = 1;
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                }
+                auto connection = std::make_unique<Connection>();
+                connection->fd = fd;
+                watch(fd, EPOLLIN, connection.get(), EPOLL_CTL_ADD);
+                connections.emplace(fd, std::move(connection));
+            }
+        }
+
+    public:
+        explicit Loop(Server& server) : server(server), epollFd(::epoll_create1(EPOLL_CLOEXEC)) {
+            if (epollFd < 0) throw std::system_error(errno, std::generic_category(), "epoll_create1");
+            // Only one loop is woken per incoming connection
+            watch(server.listenFd, EPOLLIN | EPOLLEXCLUSIVE, &LISTENER_TAG, EPOLL_CTL_ADD);
+            watch(server.wakeFd, EPOLLIN, &WAKE_TAG, EPOLL_CTL_ADD);
+        }
+
+        Loop(const Loop&) = delete;
+        Loop& operator=(const Loop&) = delete;
+
+        ~Loop() {
+            for (auto& [fd, connection] : connections) ::close(fd);
+            ::close(epollFd);
+        }
+
+        void run() {
+            epoll_event events[MAX_EVENTS];
+            while (true) {
+                int count = ::epoll_wait(epollFd, events, MAX_EVENTS, -1);
+                if (count < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+                for (int i = 0; i < count; i++) {
+                    void* data = events[i].data.ptr;
+                    if (data == &WAKE_TAG) return;
+                    if (data == &LISTENER_TAG) {
+                        acceptAll();
+                        continue;
+                    }
+
+                    Connection& connection = *static_cast<Connection*>(data);
+                    bool open = connection.waitingToWrite && !(events[i].events & EPOLLERR)
+                                    ? flush(connection) && !(connection.peerClosed && !connection.waitingToWrite)
+                                    : readFrames(connection);
+                    if (!open) close(connection);
+                }
+            }
+        }
+    };
+
+    const Calculator& calc;
+    Endpoint endpoint;
+    int listenFd = -1;
+    int wakeFd = -1;
+    std::uint16_t boundPort = 0;
+    std::vector<std::unique_ptr<Loop>> loops;
+
+    static void encodeLength(char* out, std::uint32_t length) {
+        for (size_t i = 0; i < HEADER_BYTES; i++) out[i] = static_cast<char>(length >> (8 * i));
+    }
+
+    static std::uint32_t decodeLength(const char* in) {
+        std::uint32_t length = 0;
+        for (size_t i = 0; i < HEADER_BYTES; i++) {
+            length |= static_cast<std::uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        return length;
+    }
+
+    void listenLocal() {
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, endpoint.path.data(), endpoint.path.size());
+        ::unlink(endpoint.path.c_str());
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            throw std::system_error(errno, std::generic_category(), "bind " + endpoint.path);
+        }
+    }
+
+    void listenTcp() {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* found = nullptr;
+        const char* host = endpoint.host.empty() ? nullptr : endpoint.host.c_str();
+        int status = ::getaddrinfo(host, endpoint.port.c_str(), &hints, &found);
+        if (status != 0) throw std::runtime_error(std::string("Cannot resolve host: ") + ::gai_strerror(status));
+        std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> addresses(found, ::freeaddrinfo);
+
+        listenFd = ::socket(found->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+        int on = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (::bind(listenFd, found->ai_addr, found->ai_addrlen) != 0) {
+            throw std::system_error(errno, std::generic_category(), "bind");
+        }
+
+        sockaddr_storage bound{};
+        socklen_t length = sizeof(bound);
+        ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&bound), &length);
+        boundPort = ntohs(bound.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&bound)->sin6_port
+                                                      : reinterpret_cast<sockaddr_in*>(&bound)->sin_port);
+    }
+
+    void closeAll() {
+        loops.clear();
+        if (listenFd >= 0) ::close(listenFd);
+        if (wakeFd >= 0) ::close(wakeFd);
+        if (endpoint.local && listenFd >= 0) ::unlink(endpoint.path.c_str());
+        listenFd = wakeFd = -1;
+    }
+
+public:
+    // Binds and listens right away, so clients can connect before run()
+    Server(const Calculator& calc, Endpoint endpoint, size_t loopCount = std::thread::hardware_concurrency())
+        : calc(calc), endpoint(std::move(endpoint)) {
+        try {
+            wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeFd < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+            if (this->endpoint.local) {
+                listenLocal();
+            } else {
+                listenTcp();
+            }
+            if (::listen(listenFd, SOMAXCONN) != 0) {
+                throw std::system_error(errno, std::generic_category(), "listen");
+            }
+            for (size_t i = 0; i < std::max<size_t>(loopCount, 1); i++) {
+                loops.push_back(std::make_unique<Loop>(*this));
+            }
+        } catch (...) {
+            closeAll();
+            throw;
+        }
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    ~Server() {
+        closeAll();
+    }
+
+    // TCP port actually bound, useful when listening on port 0
+    std::uint16_t port() const {
+        return boundPort;
+    }
+
+    // Serves until stop(), running the first loop on the calling thread.
+    // A loop that fails stops the whole server and its error is rethrown.
+    void run() {
+        std::exception_ptr error;
+        std::atomic<bool> failed{false};
+        auto serve = [&](Loop& loop) {
+            try {
+                loop.run();
+            } catch (...) {
+                if (!failed.exchange(true)) error = std::current_exception();
+                stop();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < loops.size(); i++) threads.emplace_back(serve, std::ref(*loops[i]));
+        serve(*loops[0]);
+        for (std::thread& thread : threads) thread.join();
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Makes run() return. Safe from any thread and from a signal handler;
+    // the wake descriptor stays readable, so every loop sees it.
+    void stop() {
+        std::uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = ::write(wakeFd, &one, sizeof(one));
+    }
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "program.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CALC_SIMD_X86 1
+#endif
+
+// Batch interpreter that executes each bytecode instruction over a block of
+// rows with GCC vector extensions. The same kernel is instantiated for
+// several lane widths, each compiled for its target ISA, and the widest one
+// the CPU supports is picked once at startup:
+//   AVX-512   8 lanes
+//   AVX2      4 lanes
+//   baseline  2 lanes (SSE2 / NEON), 1 lane elsewhere
+class SimdEvaluator {
+private:
+    // Rows processed per instruction, a multiple of every lane width
+    static constexpr size_t BLOCK = 256;
+
+    // Stack slots and temporaries a program may need, each BLOCK rows
+    // wide; this keeps every thread's scratch within 2 MiB
+    static constexpr size_t MAX_SLOTS = 1024;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    static constexpr int GENERIC_LANES = 2;
+#else
+    static constexpr int GENERIC_LANES = 1;
+#endif
+
+    template <int W>
+    struct Lanes {
+        typedef double Vec __attribute__((vector_size(W * sizeof(double))));
+        typedef long long Mask __attribute__((vector_size(W * sizeof(double))));
+    };
+
+    // Returns the rows written: all of them, or the rows before the block
+    // that divided by zero
+    using Kernel = size_t (*)(const Program&, std::span<const std::span<const double>>,
+                              size_t, size_t, double*);
+
+    // Per-thread block storage, grown to the largest program run on the
+    // thread and then reused, so steady-state batches never allocate.
+    // MAX_SLOTS bounds what it can grow to.
+    static double* scratch(size_t count) {
+        static thread_local std::vector<double> storage;
+        if (storage.size() < count) storage.resize(count);
+        return storage.data();
+    }
+
+    template <int W>
+    [[gnu::always_inline]] static inline size_t
+    runBlocks(const Program& program, std::span<const std::span<const double>> columns,
+              size_t begin, size_t end, double* out) {
+        using Vec = typename Lanes<W>::Vec;
+        using Mask = typename Lanes<W>::Mask;
+        constexpr size_t VECS_PER_SLOT = BLOCK / W;
+
+        Vec lane{};
+        for (int i = 0; i < W; i++) lane[i] = i;
+
+        // Over-allocate and align by hand: std::allocator does not see the
+        // natural alignment of a dependent vector_size type
+        // Value stack slots followed by one slot per temporary
+        size_t slots = slotsOf(program);
+        void* raw = scratch(slots * BLOCK + W);
+        size_t space = (slots * BLOCK + W) * sizeof(double);
+        Vec* stack = static_cast<Vec*>(std::align(sizeof(Vec), slots * BLOCK * sizeof(double), raw, space));
+
+        for (size_t row = begin; row < end; row += BLOCK) {
+            size_t count = end - row < BLOCK ? end - row : BLOCK;
+            size_t vecs = (count + W - 1) / W;
+            // Lanes of the last vector that hold real rows
+            Mask tail = lane < static_cast<double>(count - (vecs - 1) * W);
+            Vec* top = stack;
+            Vec* temps = stack + program.maxDepth * VECS_PER_SLOT;
+
+            for (const Instruction& instr : program.code) {
+                if (instr.op == OpCode::Push) {
+                    Vec value = Vec{} + instr.value;
+                    for (size_t j = 0; j < vecs; j++) top[j] = value;
+                    top += VECS_PER_SLOT;
+                    continue;
+                }
+                if (instr.op == OpCode::StoreTemp) {
+                    std::memcpy(temps + instr.index * VECS_PER_SLOT, top - VECS_PER_SLOT, vecs * sizeof(Vec));
+                    continue;
+                }
+                if (instr.op == OpCode::LoadTemp) {
+                    std::memcpy(top, temps + instr.index * VECS_PER_SLOT, vecs * sizeof(Vec));
+                    top += VECS_PER_SLOT;
+                    continue;
+                }
+                if (instr.op == OpCode::Neg) {
+                    Vec* a = top - VECS_PER_SLOT;
+                    for (size_t j = 0; j < vecs; j++) a[j] = -a[j];
+                    continue;
+                }
+                if (instr.op == OpCode::Load) {
+                    const double* column = columns[instr.index].data() + row;
+                    size_t full = count / W;
+                    std::memcpy(top, column, full * sizeof(Vec));
+                    if (full < vecs) {
+                        top[full] = Vec{};
+                        std::memcpy(&top[full], column + full * W, (count - full * W) * sizeof(double));
+                    }
+                    top += VECS_PER_SLOT;
+                    continue;
+                }
+
+                top -= VECS_PER_SLOT;
+                const Vec* b = top;
+                Vec* a = top - VECS_PER_SLOT;
+                switch (instr.op) {
+                    case OpCode::Add:
+                        for (size_t j = 0; j < vecs; j++) a[j] += b[j];
+                        break;
+                    case OpCode::Sub:
+                        for (size_t j = 0; j < vecs; j++) a[j] -= b[j];
+                        break;
+                    case OpCode::Mul:
+                        for (size_t j = 0; j < vecs; j++) a[j] *= b[j];
+                        break;
+                    case OpCode::Div:
+                    case OpCode::Mod: {
+                        // Zero divisors are collected as a lane mask and only
+                        // inspected once per block
+                        Mask zero{};
+                        for (size_t j = 0; j + 1 < vecs; j++) zero |= b[j] == 0.0;
+                        zero |= (b[vecs - 1] == 0.0) & tail;
+                        for (int i = 0; i < W; i++) {
+                            if (zero[i]) return row - begin;
+                        }
+                        if (instr.op == OpCode::Div) {
+                            for (size_t j = 0; j < vecs; j++) a[j] /= b[j];
+                        } else {
+                            for (size_t j = 0; j < vecs; j++) {
+                                for (int i = 0; i < W; i++) a[j][i] = std::fmod(a[j][i], b[j][i]);
+                            }
+                        }
+                        break;
+                    }
+                    case OpCode::Pow:
+                        // std::pow lane by lane, as the scalar and native tiers
+                        // do, so every tier rounds powers the same way
+                        for (size_t j = 0; j < vecs; j++) {
+                            for (int i = 0; i < W; i++) a[j][i] = std::pow(a[j][i], b[j][i]);
+                        }
+                        break;
+                    default:
+                        throw std::runtime_error("Invalid operator");
+                }
+            }
+            std::memcpy(out + (row - begin), stack, count * sizeof(double));
+        }
+        return end - begin;
+    }
+
+#ifdef CALC_SIMD_X86
+    [[gnu::target("avx512f")]]
+    static size_t runAvx512(const Program& program, std::span<const std::span<const double>> columns,
+                          size_t begin, size_t end, double* out) {
+        return runBlocks<8>(program, columns, begin, end, out);
+    }
+
+    [[gnu::target("avx2")]]
+    static size_t runAvx2(const Program& program, std::span<const std::span<const double>> columns,
+                        size_t begin, size_t end, double* out) {
+        return runBlocks<4>(program, columns, begin, end, out);
+    }
+#endif
+
+    static size_t slotsOf(const Program& program) {
+        return (program.maxDepth ? program.maxDepth : 1) + program.tempCount;
+    }
+
+    static size_t runGeneric(const Program& program, std::span<const std::span<const double>> columns,
+                           size_t begin, size_t end, double* out) {
+        return runBlocks<GENERIC_LANES>(program, columns, begin, end, out);
+    }
+
+    struct Target {
+        Kernel kernel;
+        const char* name;
+    };
+
+    static Target selectTarget() {
+#ifdef CALC_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return {runAvx512, "avx512"};
+        if (__builtin_cpu_supports("avx2")) return {runAvx2, "avx2"};
+#endif
+        return {runGeneric, GENERIC_LANES > 1 ? "sse2/neon" : "scalar"};
+    }
+
+    static const Target& target() {
+        static const Target selected = selectTarget();
+        return selected;
+    }
+
+public:
+    // Whether the program's stack and temporaries fit the per-thread
+    // scratch; the caller evaluates larger programs row by row
+    static bool fits(const Program& program) {
+        return slotsOf(program) <= MAX_SLOTS;
+    }
+
+    // Evaluates rows [begin, end) of the columns into out[0, end - begin).
+    // The program must fit().
+    static void run(const Program& program, std::span<const std::span<const double>> columns,
+                    size_t begin, size_t end, double* out) {
+        if (runUntilError(program, columns, begin, end, out) != end - begin) {
+            throw std::runtime_error("Division by zero");
+        }
+    }
+
+    // Non-throwing run(): returns the rows written, fewer than asked when a
+    // row divides by zero. That row is within the next BLOCK rows.
+    static size_t runUntilError(const Program& program, std::span<const std::span<const double>> columns,
+                                size_t begin, size_t end, double* out) {
+        return target().kernel(program, columns, begin, end, out);
+    }
+
+    // Name of the instruction set picked for this CPU
+    static const char* isaName() {
+        return target().name;
+    }
+};
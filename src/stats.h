@@ -0,0 +1,415 @@
+#pragma once
+
+// Evaluation metrics: per-phase latency histograms, operation counts and
+// the opcode pair profile that shows which superinstructions (fusion.h)
+// would pay off. Off by default; build with -DCALC_ENABLE_STATS=1 to
+// collect them. When off, timers and counters are empty inline functions
+// and every snapshot is zero.
+#ifndef CALC_ENABLE_STATS
+#define CALC_ENABLE_STATS 0
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "format.h"
+#include "fusion.h"
+#include "program.h"
+#include "program_cache.h"
+
+enum class Phase : std::uint8_t {
+    Evaluate,   // evaluate() end to end: cache lookup, compile on a miss, run
+    Lex,        // Validation and tokenizing
+    Compile,    // Parsing tokens into bytecode
+    Optimize,
+    Execute,    // One scalar run of a compiled program
+    Batch,      // One evaluateBatch() call
+    Format,     // Rendering a result as text
+    COUNT
+};
+
+inline constexpr size_t PHASE_COUNT = static_cast<size_t>(Phase::COUNT);
+
+inline const char* phaseName(Phase phase) {
+    static const char* const NAMES[PHASE_COUNT] = {
+        "evaluate", "lex", "compile", "optimize", "execute", "batch", "format"};
+    return NAMES[static_cast<size_t>(phase)];
+}
+
+struct PhaseStats {
+    std::uint64_t count = 0;
+    std::uint64_t totalNanos = 0;
+    std::uint64_t maxNanos = 0;
+    // Upper bounds of the histogram buckets holding these quantiles
+    std::uint64_t p50Nanos = 0;
+    std::uint64_t p90Nanos = 0;
+    std::uint64_t p99Nanos = 0;
+};
+
+// Metric labels of the opcodes, in OpCode order
+inline constexpr std::array<const char*, OPCODE_COUNT> OPCODE_NAMES = {
+    "push", "load", "store_temp", "load_temp", "add", "sub", "mul", "div", "mod", "pow", "neg"};
+
+// Run counters, in this order: one per opcode, one per pair of adjacent
+// opcodes and one per fusion rule
+inline constexpr size_t PAIR_COUNTERS = OPCODE_COUNT;
+inline constexpr size_t SAVING_COUNTERS = PAIR_COUNTERS + OPCODE_COUNT * OPCODE_COUNT;
+inline constexpr size_t RUN_COUNTER_COUNT = SAVING_COUNTERS + FUSION_RULE_COUNT;
+
+// What one run of a program adds to each nonzero run counter. Found once
+// when the program is compiled, so counting a run does not walk its code.
+struct CodeProfile {
+    std::vector<std::pair<std::uint16_t, std::uint32_t>> counts;
+
+    static CodeProfile of(std::span<const Instruction> code) {
+        std::array<std::uint32_t, RUN_COUNTER_COUNT> dense{};
+        for (size_t i = 0; i < code.size(); i++) {
+            size_t op = static_cast<std::uint8_t>(code[i].op);
+            dense[op]++;
+            if (i > 0) dense[PAIR_COUNTERS + static_cast<std::uint8_t>(code[i - 1].op) * OPCODE_COUNT + op]++;
+        }
+        std::array<std::uint32_t, FUSION_RULE_COUNT> saved = Fusion::savings(code);
+        for (size_t rule = 0; rule < FUSION_RULE_COUNT; rule++) dense[SAVING_COUNTERS + rule] = saved[rule];
+
+        CodeProfile profile;
+        for (size_t i = 0; i < dense.size(); i++) {
+            if (dense[i]) profile.counts.push_back({static_cast<std::uint16_t>(i), dense[i]});
+        }
+        return profile;
+    }
+};
+
+struct StatsSnapshot {
+    bool enabled = false;
+    std::array<PhaseStats, PHASE_COUNT> phases{};
+    std::uint64_t evaluations = 0;              // Programs run, one per batch row
+    std::array<std::uint64_t, 256> operations{}; // Executed instructions by opcode
+    // Executed instructions by opcode and the opcode before them in the program
+    std::array<std::array<std::uint64_t, OPCODE_COUNT>, OPCODE_COUNT> pairs{};
+    // Dispatches each superinstruction removes from the executed code
+    std::array<std::uint64_t, FUSION_RULE_COUNT> fusionSavings{};
+    CacheStats cache;
+
+    std::uint64_t totalOperations() const {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : operations) total += count;
+        return total;
+    }
+
+    // Prometheus text exposition format
+    std::string prometheus() const {
+        std::string text;
+        auto seconds = [&](std::uint64_t nanos) {
+            appendNumber(text, static_cast<double>(nanos) / 1e9);
+        };
+
+        text += "# HELP calc_phase_seconds Latency of each evaluation phase\n";
+        text += "# TYPE calc_phase_seconds summary\n";
+        for (size_t i = 0; i < PHASE_COUNT; i++) {
+            const PhaseStats& phase = phases[i];
+            std::string label = std::string("phase=\"") + phaseName(static_cast<Phase>(i)) + "\"";
+            const std::pair<const char*, std::uint64_t> quantiles[] = {
+                {"0.5", phase.p50Nanos}, {"0.9", phase.p90Nanos}, {"0.99", phase.p99Nanos}};
+            for (const auto& [quantile, nanos] : quantiles) {
+                text += "calc_phase_seconds{" + label + ",quantile=\"" + quantile + "\"} ";
+                seconds(nanos);
+                text += '\n';
+            }
+            text += "calc_phase_seconds_sum{" + label + "} ";
+            seconds(phase.totalNanos);
+            text += "\ncalc_phase_seconds_count{" + label + "} " + std::to_string(phase.count) + '\n';
+        }
+
+        text += "# HELP calc_evaluations_total Programs run, counting every batch row\n";
+        text += "# TYPE calc_evaluations_total counter\n";
+        text += "calc_evaluations_total " + std::to_string(evaluations) + '\n';
+
+        text += "# HELP calc_operations_total Instructions executed by opcode\n";
+        text += "# TYPE calc_operations_total counter\n";
+        for (size_t op = 0; op < OPCODE_NAMES.size(); op++) {
+            text += std::string("calc_operations_total{op=\"") + OPCODE_NAMES[op] + "\"} " +
+                    std::to_string(operations[op]) + '\n';
+        }
+
+        text += "# HELP calc_opcode_pairs_total Executed instructions by opcode and the opcode before them\n";
+        text += "# TYPE calc_opcode_pairs_total counter\n";
+        for (size_t first = 0; first < OPCODE_COUNT; first++) {
+            for (size_t second = 0; second < OPCODE_COUNT; second++) {
+                if (pairs[first][second] == 0) continue;
+                text += std::string("calc_opcode_pairs_total{first=\"") + OPCODE_NAMES[first] + "\",second=\"" +
+                        OPCODE_NAMES[second] + "\"} " + std::to_string(pairs[first][second]) + '\n';
+            }
+        }
+
+        text += "# HELP calc_fusion_saved_dispatches_total Dispatches each superinstruction removes\n";
+        text += "# TYPE calc_fusion_saved_dispatches_total counter\n";
+        for (size_t rule = 0; rule < FUSION_RULE_COUNT; rule++) {
+            text += std::string("calc_fusion_saved_dispatches_total{rule=\"") +
+                    fusionRuleName(static_cast<FusionRule>(rule)) + "\"} " + std::to_string(fusionSavings[rule]) +
+                    '\n';
+        }
+
+        text += "# TYPE calc_cache_hits_total counter\n";
+        text += "calc_cache_hits_total " + std::to_string(cache.hits) + '\n';
+        text += "# TYPE calc_cache_misses_total counter\n";
+        text += "calc_cache_misses_total " + std::to_string(cache.misses) + '\n';
+        text += "# TYPE calc_cache_evictions_total counter\n";
+        text += "calc_cache_evictions_total " + std::to_string(cache.evictions) + '\n';
+        text += "# TYPE calc_cache_entries gauge\n";
+        text += "calc_cache_entries " + std::to_string(cache.entries) + '\n';
+        return text;
+    }
+
+    // Which superinstructions pay off on the profiled workload, most
+    // dispatches saved first, followed by the hottest opcode pairs. Every
+    // line is a comment, so it can follow prometheus() in one exposition.
+    std::string fusionReport(size_t topPairs = 10) const {
+        std::uint64_t total = totalOperations();
+        std::string text = "# fusion report: " + std::to_string(total) + " dispatches\n";
+        if (total == 0) return text;
+        auto share = [&](std::uint64_t count) {
+            text += " (";
+            appendNumber(text, std::round(static_cast<double>(count) * 1000 / static_cast<double>(total)) / 10);
+            text += "%)";
+        };
+
+        std::array<size_t, FUSION_RULE_COUNT> rules;
+        for (size_t i = 0; i < rules.size(); i++) rules[i] = i;
+        std::stable_sort(rules.begin(), rules.end(),
+                         [&](size_t a, size_t b) { return fusionSavings[a] > fusionSavings[b]; });
+        for (size_t rule : rules) {
+            text += std::string("#   ") + fusionRuleName(static_cast<FusionRule>(rule)) + " saves " +
+                    std::to_string(fusionSavings[rule]);
+            share(fusionSavings[rule]);
+            text += '\n';
+        }
+
+        std::vector<std::pair<std::uint64_t, size_t>> hottest;
+        for (size_t i = 0; i < OPCODE_COUNT * OPCODE_COUNT; i++) {
+            std::uint64_t count = pairs[i / OPCODE_COUNT][i % OPCODE_COUNT];
+            if (count) hottest.push_back({count, i});
+        }
+        std::sort(hottest.begin(), hottest.end(), std::greater<>());
+        if (hottest.size() > topPairs) hottest.resize(topPairs);
+        for (const auto& [count, i] : hottest) {
+            text += std::string("#   pair ") + OPCODE_NAMES[i / OPCODE_COUNT] + ' ' + OPCODE_NAMES[i % OPCODE_COUNT] +
+                    ' ' + std::to_string(count);
+            share(count);
+            text += '\n';
+        }
+        return text;
+    }
+};
+
+// HDR-style latency histogram: 16 linear sub-buckets per power of two, so
+// every recorded value is within 6.25% of its bucket bound, from 1 ns up
+// to the full 64-bit range, in under 8 KiB of relaxed atomic counters.
+class LatencyHistogram {
+private:
+    static constexpr int SUB_BITS = 4;
+    static constexpr std::uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static constexpr size_t BUCKET_COUNT = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    std::array<std::atomic<std::uint64_t>, BUCKET_COUNT> buckets{};
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<std::uint64_t> max{0};
+
+    static size_t bucketOf(std::uint64_t value) {
+        if (value < SUB_COUNT) return static_cast<size_t>(value);
+        int shift = std::bit_width(value) - 1 - SUB_BITS;
+        return static_cast<size_t>((shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT));
+    }
+
+    // Largest value that falls into `bucket`
+    static std::uint64_t upperBound(size_t bucket) {
+        if (bucket < SUB_COUNT) return bucket;
+        int shift = static_cast<int>(bucket / SUB_COUNT) - 1;
+        std::uint64_t sub = bucket % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(std::uint64_t nanos) {
+        buckets[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(nanos, std::memory_order_relaxed);
+        std::uint64_t seen = max.load(std::memory_order_relaxed);
+        while (nanos > seen && !max.compare_exchange_weak(seen, nanos, std::memory_order_relaxed)) {}
+    }
+
+    PhaseStats snapshot() const {
+        PhaseStats stats;
+        stats.count = count.load(std::memory_order_relaxed);
+        stats.totalNanos = total.load(std::memory_order_relaxed);
+        stats.maxNanos = max.load(std::memory_order_relaxed);
+        if (stats.count == 0) return stats;
+
+        std::uint64_t seen = 0;
+        std::uint64_t p50 = (stats.count + 1) / 2;
+        std::uint64_t p90 = (stats.count * 9 + 9) / 10;
+        std::uint64_t p99 = (stats.count * 99 + 99) / 100;
+        for (size_t i = 0; i < BUCKET_COUNT && seen < p99; i++) {
+            std::uint64_t inBucket = buckets[i].load(std::memory_order_relaxed);
+            if (inBucket == 0) continue;
+            seen += inBucket;
+            if (stats.p50Nanos == 0 && seen >= p50) stats.p50Nanos = upperBound(i);
+            if (stats.p90Nanos == 0 && seen >= p90) stats.p90Nanos = upperBound(i);
+            if (seen >= p99) stats.p99Nanos = upperBound(i);
+        }
+        return stats;
+    }
+
+    void clear() {
+        for (auto& bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+        count = 0;
+        total = 0;
+        max = 0;
+    }
+};
+
+#if CALC_ENABLE_STATS
+
+// Thread-safe collector owned by a Calculator
+class Stats {
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    // Run counters written by the threads that picked this shard. Each
+    // thread keeps to one, so up to SHARD_COUNT threads never write the
+    // same cache line; snapshots add the shards up.
+    struct alignas(64) Shard {
+        std::atomic<std::uint64_t> evaluations{0};
+        std::array<std::atomic<std::uint64_t>, RUN_COUNTER_COUNT> counters{};
+    };
+
+    std::array<LatencyHistogram, PHASE_COUNT> histograms;
+    std::array<Shard, SHARD_COUNT> shards;
+
+    static Shard& shardOf(std::array<Shard, SHARD_COUNT>& shards) {
+        static std::atomic<size_t> nextThread{0};
+        thread_local size_t index = nextThread.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+        return shards[index];
+    }
+
+    void count(const CodeProfile& profile, std::uint64_t rows) {
+        Shard& shard = shardOf(shards);
+        shard.evaluations.fetch_add(rows, std::memory_order_relaxed);
+        for (const auto& [counter, amount] : profile.counts) {
+            shard.counters[counter].fetch_add(amount * rows, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Records the lifetime of the scope into one phase
+    class Timer {
+    private:
+        Stats& stats;
+        Phase phase;
+        Clock::time_point start;
+
+    public:
+        Timer(Stats& stats, Phase phase) : stats(stats), phase(phase), start(Clock::now()) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+            stats.histograms[static_cast<size_t>(phase)].record(static_cast<std::uint64_t>(elapsed.count()));
+        }
+    };
+
+    Timer time(Phase phase) {
+        return Timer(*this, phase);
+    }
+
+    // Compiled programs carry their profile, so a run costs one add per
+    // counter it touches
+    void attachProfile(Program& program) {
+        program.profile = std::make_shared<const CodeProfile>(CodeProfile::of(program.code));
+    }
+
+    // Counts `rows` runs of a program's instructions, the adjacent opcode
+    // pairs among them and what fusing them would save. Programs built by
+    // hand have no profile and are profiled on every run.
+    void countRuns(const Program& program, std::uint64_t rows) {
+        if (program.profile) {
+            count(*program.profile, rows);
+        } else {
+            countRuns(program.code, rows);
+        }
+    }
+
+    // Loaded program files are profiled on every run
+    void countRuns(std::span<const Instruction> code, std::uint64_t rows) {
+        count(CodeProfile::of(code), rows);
+    }
+
+    StatsSnapshot snapshot() const {
+        StatsSnapshot snapshot;
+        snapshot.enabled = true;
+        for (size_t i = 0; i < PHASE_COUNT; i++) snapshot.phases[i] = histograms[i].snapshot();
+        std::array<std::uint64_t, RUN_COUNTER_COUNT> totals{};
+        for (const Shard& shard : shards) {
+            snapshot.evaluations += shard.evaluations.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < totals.size(); i++) totals[i] += shard.counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t op = 0; op < OPCODE_COUNT; op++) {
+            snapshot.operations[op] = totals[op];
+            for (size_t next = 0; next < OPCODE_COUNT; next++) {
+                snapshot.pairs[op][next] = totals[PAIR_COUNTERS + op * OPCODE_COUNT + next];
+            }
+        }
+        for (size_t rule = 0; rule < FUSION_RULE_COUNT; rule++) {
+            snapshot.fusionSavings[rule] = totals[SAVING_COUNTERS + rule];
+        }
+        return snapshot;
+    }
+
+    void clear() {
+        for (auto& histogram : histograms) histogram.clear();
+        for (Shard& shard : shards) {
+            shard.evaluations.store(0, std::memory_order_relaxed);
+            for (auto& counter : shard.counters) counter.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+#else
+
+class Stats {
+public:
+    struct Timer {};
+
+    Timer time(Phase) {
+        return {};
+    }
+
+    void attachProfile(Program&) {}
+
+    void countRuns(const Program&, std::uint64_t) {}
+
+    void countRuns(std::span<const Instruction>, std::uint64_t) {}
+
+    StatsSnapshot snapshot() const {
+        return {};
+    }
+
+    void clear() {}
+};
+
+#endif
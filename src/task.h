@@ -0,0 +1,193 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <semaphore>
+#include <stdexcept>
+#include <stop_token>
+#include <type_traits>
+#include <utility>
+
+#include "thread_pool.h"
+
+// Lazy coroutine returning a T. Nothing runs until the task is awaited; the
+// awaiting coroutine is resumed directly when the task finishes, on
+// whichever thread finished it. A Task owns its coroutine frame.
+template <typename T>
+class Task;
+
+namespace detail {
+
+template <typename T>
+struct TaskResult {
+    std::optional<T> value;
+    std::exception_ptr error;
+
+    void return_value(T result) {
+        value.emplace(std::move(result));
+    }
+
+    T take() {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskResult<void> {
+    std::exception_ptr error;
+
+    void return_void() {}
+
+    void take() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+}  // namespace detail
+
+template <typename T>
+class Task {
+public:
+    struct promise_type : detail::TaskResult<T> {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept {
+                return self.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { this->error = std::current_exception(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+public:
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() {
+        return handle.promise().take();
+    }
+};
+
+// co_await resumeOn(executor) continues the coroutine as a task on the
+// executor, letting whatever else it runs go first. With an empty
+// executor the coroutine simply carries on.
+inline auto resumeOn(const Executor& executor) {
+    struct Awaiter {
+        const Executor& executor;
+        bool await_ready() const noexcept { return !executor; }
+        // The awaiter and `executor` may live in the coroutine frame, which
+        // the submitted task can resume and free before submission returns;
+        // only the local copy is used after the handoff
+        void await_suspend(std::coroutine_handle<> handle) const {
+            Executor submit = executor;
+            submit([handle] { handle.resume(); });
+        }
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{executor};
+}
+
+namespace detail {
+
+// Fire-and-forget coroutine that runs to completion on its own
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() noexcept {}
+    };
+};
+
+template <typename T>
+using WaitResult = std::optional<std::conditional_t<std::is_void_v<T>, bool, T>>;
+
+template <typename T>
+Detached awaitAndSignal(Task<T>& task, WaitResult<T>& result, std::exception_ptr& error,
+                        std::binary_semaphore& done) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+            result.emplace(true);
+        } else {
+            result.emplace(co_await task);
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    done.release();
+}
+
+}  // namespace detail
+
+// Blocks the calling thread until the task finishes, for code outside any
+// coroutine
+template <typename T>
+T syncWait(Task<T> task) {
+    std::binary_semaphore done{0};
+    std::exception_ptr error;
+    detail::WaitResult<T> result;
+    detail::awaitAndSignal(task, result, error, done);
+    done.acquire();
+
+    if (error) std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>) return std::move(*result);
+}
+
+struct EvaluationCancelled : std::runtime_error {
+    EvaluationCancelled() : std::runtime_error("Evaluation cancelled") {}
+};
+
+struct DeadlineExceeded : std::runtime_error {
+    DeadlineExceeded() : std::runtime_error("Deadline exceeded") {}
+};
+
+// Where asynchronous evaluation runs and when it gives up. This is a
+// coarse check: stops are honoured only between phases (lex, compile,
+// optimize, run) and between batch chunks, never inside one. A phase runs
+// to its end, so a deadline can be overshot by one phase over the whole
+// input. Each phase is linear in the input, and InputLimits::maxLength
+// bounds the overshoot.
+struct AsyncOptions {
+    using Clock = std::chrono::steady_clock;
+
+    Executor executor;      // Empty: run on whichever thread resumes the task
+    std::stop_token stop;
+    Clock::time_point deadline = Clock::time_point::max();
+
+    void checkpoint() const {
+        if (stop.stop_requested()) throw EvaluationCancelled();
+        if (deadline != Clock::time_point::max() && Clock::now() >= deadline) throw DeadlineExceeded();
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a task somewhere, at some point. Callers can plug their own
+// scheduler into the parallel evaluation entry points through this.
+using Executor = std::function<void(std::function<void()>)>;
+
+// Fixed-size pool where every worker owns a task deque. Workers pop their
+// own newest task first and steal the oldest task of another worker when
+// they run dry, so nested submissions stay local and cache-warm.
+class ThreadPool {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextQueue{0};
+
+    // Submitting and taking tasks only touch the deques and these
+    // counters; sleepMutex is taken by workers about to sleep, and by
+    // submit only when one might be
+    std::atomic<size_t> queued{0};      // Tasks in the deques
+    std::atomic<size_t> sleepers{0};    // Workers waiting, or about to, on `wake`
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;              // Guarded by sleepMutex
+
+    static ThreadPool*& currentPool() {
+        static thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static size_t& currentIndex() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    bool popLocal(size_t index, std::function<void()>& task) {
+        Worker& worker = *workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) return false;
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        queued.fetch_sub(1);
+        return true;
+    }
+
+    bool steal(size_t thief, std::function<void()>& task) {
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker& victim = *workers[(thief + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index) {
+        currentPool() = this;
+        currentIndex() = index;
+
+        while (true) {
+            std::function<void()> task;
+            if (popLocal(index, task) || steal(index, task)) {
+                task();
+                continue;
+            }
+
+            // Found nothing. Counting ourselves as a sleeper before checking
+            // `queued` means a submit either is seen here, or sees us and
+            // notifies under the lock once we wait.
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepers.fetch_add(1);
+            wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+            sleepers.fetch_sub(1);
+            if (stopping && queued.load() == 0) return;
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency()) {
+        threadCount = std::max<size_t>(threadCount, 1);
+        for (size_t i = 0; i < threadCount; i++) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < threadCount; i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Finishes every queued task, then joins the workers
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        size_t index = currentPool() == this
+            ? currentIndex()
+            : nextQueue.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->mutex);
+            workers[index]->tasks.push_back(std::move(task));
+            queued.fetch_add(1);
+        }
+        if (sleepers.load() > 0) {
+            // The lock waits out a worker between its check and its wait
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+    Executor executor() {
+        return [this](std::function<void()> task) { submit(std::move(task)); };
+    }
+
+    // Library-wide pool with one worker per hardware thread
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+};
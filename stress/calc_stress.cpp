@@ -0,0 +1,288 @@
+// Adversarial input shapes at doubling sizes. Each shape must take time
+// linear in its size, peak memory must stay proportional to the largest
+// input, and inputs past the configured limits must be rejected before the
+// engine does any real work. Every execution tier must also give the same
+// bits for the same rows. Exits non-zero if any check fails.
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "calculator.h"
+#include "fusion.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t MIN_BYTES = size_t{1} << 15;
+constexpr size_t MAX_BYTES = size_t{1} << 20;
+
+// Per-byte cost may grow this much from the smallest to the largest size.
+// Linear work grows only as its data falls out of cache; quadratic work
+// would grow 32 times.
+constexpr double MAX_COST_GROWTH = 5.0;
+
+// Peak resident memory allowed per byte of the largest input
+constexpr long MAX_BYTES_OF_MEMORY_PER_BYTE = 1024;
+
+// Input over a limit that is visible before lexing finishes is rejected
+// within this, however long the input
+constexpr double MAX_EARLY_REJECT_MICROSECONDS = 1000;
+
+// Generators fill about `bytes` characters of one shape
+using Shape = std::string (*)(size_t bytes);
+
+std::string repeat(std::string_view unit, std::string_view separator, size_t bytes) {
+    std::string text(unit);
+    while (text.size() < bytes) {
+        text += separator;
+        text += unit;
+    }
+    return text;
+}
+
+std::string flatChain(size_t bytes) {
+    return repeat("1", "+2*3-4/5+", bytes);
+}
+
+std::string digitRun(size_t bytes) {
+    return std::string(bytes, '7');
+}
+
+std::string fractionRun(size_t bytes) {
+    std::string text = "0.";
+    text.append(bytes, '3');
+    return text + "+1";
+}
+
+// Groups nested 64 deep, side by side
+std::string nestedGroups(size_t bytes) {
+    return repeat(std::string(64, '(') + "1" + std::string(64, ')'), "+", bytes);
+}
+
+std::string signChains(size_t bytes) {
+    return repeat(std::string(64, '-') + "1", "*", bytes);
+}
+
+std::string powerChains(size_t bytes) {
+    return repeat("(1^1^1^1^1^1^1^1^1^1^1^1^1^1^1^1)", "+", bytes);
+}
+
+// Every term is a new variable
+std::string distinctVariables(size_t bytes) {
+    std::string text = "v0";
+    for (size_t i = 1; text.size() < bytes; i++) {
+        text += "+v";
+        text += std::to_string(i);
+    }
+    return text;
+}
+
+// Nothing folds, so the optimizer sees a tree as deep as the chain
+std::string variableChain(size_t bytes) {
+    return repeat("+1", "", bytes).insert(0, 1, 'x');
+}
+
+std::string longName(size_t bytes) {
+    return std::string(bytes, 'x') + "*2";
+}
+
+struct Case {
+    const char* name;
+    Shape shape;
+};
+
+const Case CASES[] = {
+    {"flat_chain", flatChain},
+    {"digit_run", digitRun},
+    {"fraction_run", fractionRun},
+    {"nested_groups", nestedGroups},
+    {"sign_chains", signChains},
+    {"power_chains", powerChains},
+    {"distinct_variables", distinctVariables},
+    {"variable_chain", variableChain},
+    {"long_name", longName},
+};
+
+long peakKilobytes() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Lex, compile, optimize and run, with every variable bound to 1
+void process(const Calculator& calc, const std::string& text) {
+    Program program = calc.optimize(calc.compile(text));
+    std::vector<double> inputs(program.variables.size(), 1.0);
+    calc.run(program, inputs);
+}
+
+double secondsFor(const std::function<void()>& work) {
+    double best = 1e30;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        auto start = Clock::now();
+        work();
+        best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return best;
+}
+
+bool checkScaling(const Case& test) {
+    const Calculator calc;
+    double firstCost = 0;
+    double lastCost = 0;
+    for (size_t bytes = MIN_BYTES; bytes <= MAX_BYTES; bytes *= 2) {
+        std::string text = test.shape(bytes);
+        double seconds = secondsFor([&] { process(calc, text); });
+        double cost = seconds * 1e9 / static_cast<double>(text.size());
+        if (bytes == MIN_BYTES) firstCost = cost;
+        lastCost = cost;
+        std::printf("%-20s %9zu bytes %10.3f ms %8.1f ns/byte\n", test.name, text.size(), seconds * 1e3, cost);
+    }
+    bool linear = lastCost <= firstCost * MAX_COST_GROWTH;
+    if (!linear) std::printf("FAIL %s: cost per byte grew %.1fx\n", test.name, lastCost / firstCost);
+    return linear;
+}
+
+// A rejection without a time bound only has to fail cleanly
+bool checkRejected(const char* name, const Calculator& calc, const std::string& text, std::string_view message,
+                   double maxMicroseconds = 1e30) {
+    std::string error;
+    double seconds = secondsFor([&] {
+        try {
+            calc.compile(text);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+    });
+    double microseconds = seconds * 1e6;
+    std::printf("%-20s %9zu bytes %10.3f us rejected: %s\n", name, text.size(), microseconds, error.c_str());
+    if (error != message) {
+        std::printf("FAIL %s: expected \"%.*s\"\n", name, static_cast<int>(message.size()), message.data());
+        return false;
+    }
+    if (microseconds > maxMicroseconds) {
+        std::printf("FAIL %s: rejection took %.0f us\n", name, microseconds);
+        return false;
+    }
+    return true;
+}
+
+bool checkLimits() {
+    bool ok = true;
+    const size_t big = size_t{16} << 20;
+
+    const Calculator shortInputs(InputLimits{1 << 16, Parser::MAX_DEPTH});
+    ok &= checkRejected("max_length", shortInputs, flatChain(big), "Expression too long",
+                        MAX_EARLY_REJECT_MICROSECONDS);
+
+    // The budget rejects text too long to fit on its length, and otherwise
+    // stops the lexer once the tokens read so far are too many
+    const Calculator smallBudget(InputLimits{.maxMemory = 1 << 20});
+    std::string longChain = flatChain(big);
+    std::string textError = MemoryBudgetExceeded(Calculator::memoryBound(longChain.size(), 0, 0), 1 << 20).what();
+    ok &= checkRejected("max_memory_text", smallBudget, longChain, textError, MAX_EARLY_REJECT_MICROSECONDS);
+    std::string chain = flatChain(MAX_BYTES / 2);
+    std::string tokensError = MemoryBudgetExceeded(smallBudget.tryEvaluate(chain).error().required, 1 << 20).what();
+    ok &= checkRejected("max_memory_tokens", smallBudget, chain, tokensError, MAX_EARLY_REJECT_MICROSECONDS);
+
+    // Past the default depth brackets fail in the lexer, as soon as they
+    // open. Sign and power chains fail in the parser, after a linear lex,
+    // which stops at the limit instead of running out of stack.
+    const Calculator calc;
+    std::string brackets = std::string(big / 2, '(') + "1" + std::string(big / 2, ')');
+    ok &= checkRejected("max_depth_brackets", calc, brackets, "Expression nested too deeply",
+                        MAX_EARLY_REJECT_MICROSECONDS);
+    ok &= checkRejected("max_depth_signs", calc, std::string(MAX_BYTES, '-') + "1", "Expression nested too deeply");
+    ok &= checkRejected("max_depth_powers", calc, repeat("2", "^", MAX_BYTES), "Expression nested too deeply");
+    return ok;
+}
+
+// Formulas whose powers and products each tier evaluates its own way
+const char* const TIER_FORMULAS[] = {
+    "x^3", "x^5", "x^-3", "x^7", "x^2", "x^0.5", "x^y", "x^3*y+x^-2", "x^7+y^5+x*y+2", "x*x*x+y^3*y^3",
+};
+
+constexpr size_t TIER_ROWS = 1000;
+
+bool sameBits(double a, double b) {
+    return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// The scalar interpreter is the reference for its fused code, the SIMD
+// batch and, once the cached program is hot, for native batches and rows
+bool checkTierAgreement() {
+    const Calculator calc;
+    std::vector<double> x(TIER_ROWS), y(TIER_ROWS);
+    for (size_t i = 0; i < TIER_ROWS; i++) {
+        x[i] = 0.25 + static_cast<double>(i) * 0.731;
+        y[i] = -3.0 + static_cast<double>(i % 13) * 0.5;
+    }
+    std::vector<std::span<const double>> columns{x, y};
+
+    bool ok = true;
+    for (const char* formula : TIER_FORMULAS) {
+        Program plain = calc.optimize(calc.compile(formula));
+        Program fused = plain;
+        fused.fused = Fusion::fuse(plain);
+        std::shared_ptr<const Program> cached = calc.compileCached(formula);
+        std::vector<double> inputs(plain.variables.size());
+        auto row = [&](size_t i) {
+            inputs[0] = x[i];
+            if (inputs.size() > 1) inputs[1] = y[i];
+            return std::span<const double>(inputs);
+        };
+
+        std::span<const std::span<const double>> bound(columns.data(), plain.variables.size());
+        std::vector<double> batch(TIER_ROWS), nativeBatch(TIER_ROWS);
+        calc.evaluateBatch(plain, bound, batch);
+        // Enough single runs for the cached program to reach the native tier
+        for (size_t i = 0; i < TIER_ROWS; i++) calc.run(*cached, row(i));
+        calc.evaluateBatch(*cached, bound, nativeBatch);
+
+        size_t differing = 0;
+        for (size_t i = 0; i < TIER_ROWS; i++) {
+            double expected = calc.run(plain, row(i));
+            differing += !sameBits(batch[i], expected) || !sameBits(nativeBatch[i], expected) ||
+                         !sameBits(calc.run(*cached, row(i)), expected) ||
+                         !sameBits(calc.run(fused, row(i)), expected);
+        }
+        std::printf("%-20s %9zu rows %10zu differing\n", formula, TIER_ROWS, differing);
+        if (differing) {
+            std::printf("FAIL %s: tiers disagree\n", formula);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+}  // namespace
+
+int main() {
+    long baseline = peakKilobytes();
+    bool ok = true;
+    for (const Case& test : CASES) ok &= checkScaling(test);
+
+    long grownBytes = (peakKilobytes() - baseline) * 1024;
+    long allowed = MAX_BYTES_OF_MEMORY_PER_BYTE * static_cast<long>(MAX_BYTES);
+    std::printf("peak memory growth %ld KiB, %.0f bytes per input byte\n", grownBytes / 1024,
+                static_cast<double>(grownBytes) / static_cast<double>(MAX_BYTES));
+    if (grownBytes > allowed) {
+        std::printf("FAIL memory: more than %ld bytes per input byte\n", MAX_BYTES_OF_MEMORY_PER_BYTE);
+        ok = false;
+    }
+
+    ok &= checkLimits();
+    ok &= checkTierAgreement();
+    std::puts(ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}